@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host side of tap benchmarks and peer process of shared memory
+ * benchmarks. Uses host sockets, so this file must not include
+ * lwIP socket headers.
+ */
+
+#include <picoos.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "benchhost.h"
+
+static int hostListen(uint16_t port)
+{
+  struct sockaddr_in addr;
+  int                s;
+  int                one = 1;
+
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s == -1)
+    return -1;
+
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (bind(s, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(s, 1) == -1) {
+
+    close(s);
+    return -1;
+  }
+
+  return s;
+}
+
+/*
+ * Send everything back until other end closes.
+ */
+static void hostEcho(int s)
+{
+  static char buf[2048];
+  ssize_t     n;
+
+  while ((n = read(s, buf, sizeof(buf))) > 0)
+    if (write(s, buf, n) != n)
+      break;
+
+  close(s);
+}
+
+/*
+ * Serve one connection at a time. Data to sink is checked and
+ * result reported to parent. Exits when parent closes its end.
+ */
+static void hostSink(int ctl, int ls, int es)
+{
+  static char            buf[65536];
+  struct benchHostResult result;
+  struct pollfd          fds[3];
+  ssize_t                n;
+  ssize_t                i;
+  int                    s;
+
+  while (true) {
+
+    fds[0].fd     = ctl;
+    fds[0].events = POLLIN;
+    fds[1].fd     = ls;
+    fds[1].events = POLLIN;
+    fds[2].fd     = es;
+    fds[2].events = POLLIN;
+    if (poll(fds, 3, -1) == -1) {
+
+      if (errno == EINTR)
+        continue;
+
+      break;
+    }
+
+    if (fds[0].revents != 0)
+      break;
+
+    if (fds[2].revents != 0) {
+
+      s = accept(es, NULL, NULL);
+      if (s != -1)
+        hostEcho(s);
+
+      continue;
+    }
+
+    s = accept(ls, NULL, NULL);
+    if (s == -1)
+      continue;
+
+    memset(&result, '\0', sizeof(result));
+    while ((n = read(s, buf, sizeof(buf))) > 0) {
+
+      for (i = 0; i < n; i++)
+        if ((uint8_t) buf[i] != (uint8_t) (result.bytes + i))
+          ++result.errors;
+
+      result.bytes += n;
+    }
+
+    close(s);
+    if (write(ctl, &result, sizeof(result)) != sizeof(result))
+      break;
+  }
+
+  _exit(0);
+}
+
+/*
+ * Start host process. Must be called before pico]OS is started.
+ * Returns descriptor for benchHostResult(), -1 on error.
+ */
+int benchHostStart(void)
+{
+  int   fds[2];
+  int   ls;
+  int   es;
+  pid_t pid;
+
+  // Listen before fork, so that connection never comes too early.
+  ls = hostListen(BENCH_HOST_SINK_PORT);
+  if (ls == -1)
+    return -1;
+
+  es = hostListen(BENCH_HOST_ECHO_PORT);
+  if (es == -1) {
+
+    close(ls);
+    return -1;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+
+    close(ls);
+    close(es);
+    return -1;
+  }
+
+  pid = fork();
+  if (pid == -1) {
+
+    close(fds[0]);
+    close(fds[1]);
+    close(ls);
+    close(es);
+    return -1;
+  }
+
+  if (pid == 0) {
+
+    close(fds[0]);
+    hostSink(fds[1], ls, es);
+  }
+
+  close(fds[1]);
+  close(ls);
+  close(es);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  return fds[0];
+}
+
+/*
+ * Wait for result of next sink connection. Task sleeps
+ * between checks, so that stack can finish the connection.
+ */
+bool benchHostResult(int fd, struct benchHostResult* result, int timeoutMs)
+{
+  int waited = 0;
+
+  while (read(fd, result, sizeof(*result)) != sizeof(*result)) {
+
+    if (waited >= timeoutMs)
+      return false;
+
+    posTaskSleep(MS(10));
+    waited += 10;
+  }
+
+  return true;
+}
+
+/*
+ * User and system CPU time of this process in microseconds.
+ */
+uint64_t benchCpuUs(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static pid_t peerPid;
+
+/*
+ * Fork peer process that runs its own pico]OS and lwIP (for benchmarks
+ * that don't go through host network stack). Must be called before
+ * pico]OS is started. *child tells which side returned. Returns
+ * descriptor for benchHostResult() in parent and for benchPeerReport()
+ * in child, -1 on error.
+ */
+int benchPeerStart(bool* child)
+{
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    return -1;
+
+  peerPid = fork();
+  if (peerPid == -1) {
+
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  *child = (peerPid == 0);
+  if (*child) {
+
+    close(fds[0]);
+    return fds[1];
+  }
+
+  close(fds[1]);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  return fds[0];
+}
+
+/*
+ * Stop peer process, called by parent.
+ */
+void benchPeerStop(int fd)
+{
+  close(fd);
+  kill(peerPid, SIGTERM);
+  waitpid(peerPid, NULL, 0);
+}
+
+/*
+ * Report result of one connection to parent, called by peer.
+ */
+bool benchPeerReport(int fd, const struct benchHostResult* result)
+{
+  return write(fd, result, sizeof(*result)) == sizeof(*result);
+}
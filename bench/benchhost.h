@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BENCHHOST_H__
+#define __BENCHHOST_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Host side of tap benchmarks. Runs in a child process that
+ * is forked before pico]OS is started, and receives TCP connections
+ * to BENCH_HOST_SINK_PORT and BENCH_HOST_ECHO_PORT through host
+ * network stack.
+ */
+#define BENCH_HOST_SINK_PORT 5001
+#define BENCH_HOST_ECHO_PORT 5003
+
+/*
+ * Result of one sink connection. Data is checked against
+ * pattern where each byte is its offset modulo 256.
+ */
+struct benchHostResult {
+
+  uint64_t bytes;   // received bytes
+  uint64_t errors;  // bytes that didn't match pattern
+};
+
+int benchHostStart(void);
+bool benchHostResult(int fd, struct benchHostResult* result, int timeoutMs);
+uint64_t benchCpuUs(void);
+
+int benchPeerStart(bool* child);
+void benchPeerStop(int fd);
+bool benchPeerReport(int fd, const struct benchHostResult* result);
+
+#endif /* __BENCHHOST_H__ */
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Mailbox benchmark. Producer tasks post messages to one mailbox
+ * as fast as they can, and a consumer task of higher priority fetches
+ * them like tcpip thread does with its mailbox. Prints posts per second
+ * with one producer and with BENCH_PRODUCERS producers.
+ *
+ * Built twice from sys_arch.c: mboxbench uses UosRing mailboxes
+ * and mboxbench-lockfree sets SYS_ARCH_LOCKFREE_MBOX, so lwipopts.h
+ * of application must not set it. Other options come from application.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 5
+#endif
+
+#ifndef BENCH_STACK_SIZE
+#define BENCH_STACK_SIZE 8192
+#endif
+
+#ifndef BENCH_PRODUCERS
+#define BENCH_PRODUCERS 4
+#endif
+
+#ifndef BENCH_MBOX_SIZE
+#define BENCH_MBOX_SIZE 64
+#endif
+
+static sys_mbox_t mbox;
+static sys_sem_t  done;
+static uint64_t   start;
+static u32_t      posted[BENCH_PRODUCERS];
+static u32_t      received;
+static int        running;
+static char       stop;
+
+/*
+ * Post until time is up, then post stop message.
+ * Clock is checked only every 64 posts.
+ */
+static void producer(void* arg)
+{
+  u32_t* count = arg;
+  u32_t  n;
+
+  n = 0;
+  do {
+
+    sys_mbox_post(&mbox, count);
+    ++n;
+  } while ((n & 63) != 0 || sys_now_us() - start < BENCH_SECONDS * 1000000ULL);
+
+  *count = n;
+  sys_mbox_post(&mbox, &stop);
+}
+
+static void consumer(void* arg)
+{
+  void* msg;
+
+  received = 0;
+  while (running > 0) {
+
+    sys_arch_mbox_fetch(&mbox, &msg, 0);
+    if (msg == &stop)
+      --running;
+    else
+      ++received;
+  }
+
+  sys_sem_signal(&done);
+}
+
+static void mboxTest(int producers)
+{
+  uint64_t elapsed;
+  u32_t    sent;
+  int      i;
+
+  if (sys_mbox_new(&mbox, BENCH_MBOX_SIZE) != ERR_OK) {
+
+    nosPrintf("mailbox creation failed\n");
+    return;
+  }
+
+  running = producers;
+  start = sys_now_us();
+  nosTaskCreate(consumer, NULL, 2, BENCH_STACK_SIZE, "consumer");
+  for (i = 0; i < producers; i++)
+    nosTaskCreate(producer, &posted[i], 1, BENCH_STACK_SIZE, "producer");
+
+  sys_sem_wait(&done);
+  elapsed = sys_now_us() - start;
+
+  sent = 0;
+  for (i = 0; i < producers; i++)
+    sent += posted[i];
+
+  nosPrintf("%d producer%s %10lu posts/s, %lu lost\n",
+            producers, producers > 1 ? "s" : " ",
+            (unsigned long) ((uint64_t) received * 1000000 / elapsed),
+            (unsigned long) (sent - received));
+
+  sys_mbox_free(&mbox);
+}
+
+static void benchMain(void* arg)
+{
+  uosInit();
+  sys_init();
+  sys_sem_new(&done, 0);
+
+  nosPrintf("mboxbench, %s mailbox, size %d, %d s per test\n",
+            SYS_ARCH_LOCKFREE_MBOX ? "lock-free" : "UosRing",
+            BENCH_MBOX_SIZE, BENCH_SECONDS);
+
+  mboxTest(1);
+  mboxTest(BENCH_PRODUCERS);
+
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  nosInit(benchMain, NULL, 1, BENCH_STACK_SIZE, 512);
+  return 0;
+}
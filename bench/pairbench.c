@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark over in-memory pair interface. Two netifs of same stack
+ * are connected with pairif, and sockets of each side are bound to
+ * their own interface (SO_BINDTODEVICE), so all traffic crosses the
+ * pair instead of being looped back inside the stack. Runs TCP bulk
+ * transfer, UDP packet rate and TCP request/response tests for
+ * BENCH_SECONDS each and prints results. Received data is checked
+ * against sent pattern, corrupted bytes are reported.
+ *
+ * lwipopts.h and pico]OS configuration come from application,
+ * LWIP_SOCKET, LWIP_TCP, LWIP_UDP and LWIP_SO_RCVTIMEO are needed.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+#include "lwip/tcpip.h"
+#include "lwip/netif.h"
+#include "lwip/sockets.h"
+
+#include "netif/pairif.h"
+
+#if !LWIP_SOCKET || !LWIP_TCP || !LWIP_UDP || !LWIP_SO_RCVTIMEO
+#error pairbench needs LWIP_SOCKET, LWIP_TCP, LWIP_UDP and LWIP_SO_RCVTIMEO
+#endif
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 5
+#endif
+
+#ifndef BENCH_STACK_SIZE
+#define BENCH_STACK_SIZE 8192
+#endif
+
+#define BULK_PORT   5001
+#define UDP_PORT    5002
+#define RR_PORT     5003
+#define BULK_SIZE   8192
+#define UDP_SIZE    64
+#define RR_SIZE     64
+
+static struct netif        clientIf;
+static struct netif        serverIf;
+static struct pairIfConfig clientConfig;
+static struct pairIfConfig serverConfig;
+
+static sys_sem_t           ready;
+static sys_sem_t           done;
+static u32_t               serverBytes;
+static u32_t               serverCount;
+static u32_t               serverErrors;
+
+static char                buf[BULK_SIZE];
+static char                serverBuf[BULK_SIZE];
+
+/*
+ * Add both interfaces of pair, runs in tcpip thread.
+ */
+static void benchNetInit(void* arg)
+{
+  ip4_addr_t ip;
+  ip4_addr_t mask;
+  ip4_addr_t gw;
+
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 0, 0, 0, 0);
+
+  IP4_ADDR(&ip, 10, 0, 0, 1);
+  netif_add(&clientIf, &ip, &mask, &gw, &clientConfig, pairIfInit, tcpip_input);
+  netif_set_up(&clientIf);
+
+  serverConfig.peer = &clientIf;
+  IP4_ADDR(&ip, 10, 0, 0, 2);
+  netif_add(&serverIf, &ip, &mask, &gw, &serverConfig, pairIfInit, tcpip_input);
+  netif_set_up(&serverIf);
+
+  sys_sem_signal((sys_sem_t*) arg);
+}
+
+static void benchAddr(struct sockaddr_in* addr, struct netif* netif, u16_t port)
+{
+  memset(addr, '\0', sizeof(*addr));
+  addr->sin_len         = sizeof(*addr);
+  addr->sin_family      = AF_INET;
+  addr->sin_port        = lwip_htons(port);
+  addr->sin_addr.s_addr = ip4_addr_get_u32(netif_ip4_addr(netif));
+}
+
+/*
+ * Create socket that sends and receives only through given interface.
+ */
+static int benchSocket(int type, struct netif* netif)
+{
+  struct ifreq ifr;
+  int          s;
+  int          one = 1;
+
+  s = lwip_socket(AF_INET, type, 0);
+  if (s < 0)
+    return s;
+
+  memset(&ifr, '\0', sizeof(ifr));
+  netif_index_to_name(netif_get_index(netif), ifr.ifr_name);
+  lwip_setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr));
+
+  if (type == SOCK_STREAM)
+    lwip_setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return s;
+}
+
+static int benchListen(u16_t port)
+{
+  struct sockaddr_in addr;
+  int                s;
+
+  s = benchSocket(SOCK_STREAM, &serverIf);
+  benchAddr(&addr, &serverIf, port);
+  lwip_bind(s, (struct sockaddr*) &addr, sizeof(addr));
+  lwip_listen(s, 1);
+  return s;
+}
+
+static int benchConnect(u16_t port)
+{
+  struct sockaddr_in addr;
+  int                s;
+
+  s = benchSocket(SOCK_STREAM, &clientIf);
+  benchAddr(&addr, &serverIf, port);
+  if (lwip_connect(s, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+
+    lwip_close(s);
+    return -1;
+  }
+
+  return s;
+}
+
+/*
+ * Count bytes that don't match pattern starting at offset.
+ */
+static u32_t benchCheck(const char* data, int len, u32_t offset)
+{
+  u32_t errors = 0;
+  int   i;
+
+  for (i = 0; i < len; i++)
+    if ((u8_t) data[i] != (u8_t) (offset + i))
+      ++errors;
+
+  return errors;
+}
+
+static void benchFill(char* data, int len, u32_t offset)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    data[i] = (char) (offset + i);
+}
+
+/*
+ * Read exactly len bytes, return false if connection was closed.
+ */
+static bool benchRecvAll(int s, char* data, int len)
+{
+  int n;
+
+  while (len > 0) {
+
+    n = lwip_recv(s, data, len, 0);
+    if (n <= 0)
+      return false;
+
+    data += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+static void bulkServer(void* arg)
+{
+  int ls;
+  int s;
+  int n;
+
+  ls = benchListen(BULK_PORT);
+  sys_sem_signal(&ready);
+
+  s = lwip_accept(ls, NULL, NULL);
+  serverBytes = 0;
+  serverErrors = 0;
+  while ((n = lwip_recv(s, serverBuf, sizeof(serverBuf), 0)) > 0) {
+
+    serverErrors += benchCheck(serverBuf, n, serverBytes);
+    serverBytes += n;
+  }
+
+  lwip_close(s);
+  lwip_close(ls);
+  sys_sem_signal(&done);
+}
+
+/*
+ * TCP bulk transfer from client to server.
+ */
+static void bulkTest(void)
+{
+  u32_t start;
+  u32_t elapsed;
+  int   s;
+
+  nosTaskCreate(bulkServer, NULL, 1, BENCH_STACK_SIZE, "bulk");
+  sys_sem_wait(&ready);
+
+  s = benchConnect(BULK_PORT);
+  if (s < 0) {
+
+    nosPrintf("tcp bulk: connect failed\n");
+    return;
+  }
+
+  // Buffer size is multiple of 256, so pattern continues over sends.
+  benchFill(buf, sizeof(buf), 0);
+  start = sys_now();
+  while (sys_now() - start < BENCH_SECONDS * 1000)
+    if (lwip_send(s, buf, sizeof(buf), 0) < 0)
+      break;
+
+  lwip_close(s);
+  sys_sem_wait(&done);
+
+  elapsed = sys_now() - start;
+  nosPrintf("tcp bulk   %8lu kbit/s, %lu corrupted bytes\n",
+            (unsigned long) ((uint64_t) serverBytes * 8 / elapsed), (unsigned long) serverErrors);
+}
+
+static void udpServer(void* arg)
+{
+  struct sockaddr_in addr;
+  struct timeval     tv;
+  int                s;
+  int                n;
+
+  s = benchSocket(SOCK_DGRAM, &serverIf);
+  benchAddr(&addr, &serverIf, UDP_PORT);
+  lwip_bind(s, (struct sockaddr*) &addr, sizeof(addr));
+
+  tv.tv_sec  = 0;
+  tv.tv_usec = 500000;
+  lwip_setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  sys_sem_signal(&ready);
+
+  // Stops when client has been silent for receive timeout.
+  serverCount = 0;
+  serverErrors = 0;
+  while ((n = lwip_recv(s, serverBuf, sizeof(serverBuf), 0)) > 0) {
+
+    serverErrors += (n != UDP_SIZE) + benchCheck(serverBuf, n, 0);
+    ++serverCount;
+  }
+
+  lwip_close(s);
+  sys_sem_signal(&done);
+}
+
+/*
+ * UDP packet rate from client to server.
+ */
+static void udpTest(void)
+{
+  struct sockaddr_in addr;
+  u32_t              start;
+  u32_t              elapsed;
+  u32_t              sent;
+  int                s;
+
+  nosTaskCreate(udpServer, NULL, 1, BENCH_STACK_SIZE, "udp");
+  sys_sem_wait(&ready);
+
+  s = benchSocket(SOCK_DGRAM, &clientIf);
+  benchAddr(&addr, &serverIf, UDP_PORT);
+
+  benchFill(buf, UDP_SIZE, 0);
+  sent = 0;
+  start = sys_now();
+  while ((elapsed = sys_now() - start) < BENCH_SECONDS * 1000)
+    if (lwip_sendto(s, buf, UDP_SIZE, 0, (struct sockaddr*) &addr, sizeof(addr)) > 0)
+      ++sent;
+
+  lwip_close(s);
+  sys_sem_wait(&done);
+
+  nosPrintf("udp sent   %8lu pps\n", (unsigned long) ((uint64_t) sent * 1000 / elapsed));
+  nosPrintf("udp recv   %8lu pps, lost %lu of %lu, %lu corrupted bytes\n",
+            (unsigned long) ((uint64_t) serverCount * 1000 / elapsed),
+            (unsigned long) (sent - serverCount), (unsigned long) sent,
+            (unsigned long) serverErrors);
+}
+
+static void rrServer(void* arg)
+{
+  int ls;
+  int s;
+  int one = 1;
+
+  ls = benchListen(RR_PORT);
+  sys_sem_signal(&ready);
+
+  s = lwip_accept(ls, NULL, NULL);
+  lwip_setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  while (benchRecvAll(s, serverBuf, RR_SIZE))
+    if (lwip_send(s, serverBuf, RR_SIZE, 0) < 0)
+      break;
+
+  lwip_close(s);
+  lwip_close(ls);
+  sys_sem_signal(&done);
+}
+
+/*
+ * TCP request/response, one transaction in flight.
+ */
+static void rrTest(void)
+{
+  uint64_t start;
+  uint64_t elapsed;
+  u32_t    count;
+  u32_t    errors;
+  int      s;
+
+  nosTaskCreate(rrServer, NULL, 1, BENCH_STACK_SIZE, "rr");
+  sys_sem_wait(&ready);
+
+  s = benchConnect(RR_PORT);
+  if (s < 0) {
+
+    nosPrintf("tcp rr: connect failed\n");
+    return;
+  }
+
+  count = 0;
+  errors = 0;
+  start = sys_now_us();
+  while ((elapsed = sys_now_us() - start) < BENCH_SECONDS * 1000000ULL) {
+
+    benchFill(buf, RR_SIZE, count);
+    if (lwip_send(s, buf, RR_SIZE, 0) < 0 || !benchRecvAll(s, buf, RR_SIZE))
+      break;
+
+    errors += benchCheck(buf, RR_SIZE, count);
+    ++count;
+  }
+
+  lwip_close(s);
+  sys_sem_wait(&done);
+
+  nosPrintf("tcp rr     %8lu trans/s, rtt %lu us, %lu corrupted bytes\n",
+            (unsigned long) ((uint64_t) count * 1000000 / elapsed),
+            (unsigned long) (count > 0 ? elapsed / count : 0), (unsigned long) errors);
+}
+
+static void benchMain(void* arg)
+{
+  sys_sem_t initDone;
+
+  uosInit();
+
+  sys_sem_new(&initDone, 0);
+  sys_sem_new(&ready, 0);
+  sys_sem_new(&done, 0);
+
+  tcpip_init(benchNetInit, &initDone);
+  sys_sem_wait(&initDone);
+
+  nosPrintf("pairbench, %d s per test\n", BENCH_SECONDS);
+  bulkTest();
+  udpTest();
+  rrTest();
+
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  nosInit(benchMain, NULL, 1, BENCH_STACK_SIZE, 512);
+  return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Ping benchmark. Sends BENCH_PINGS ICMP echo requests one at a time
+ * from lwIP through tapif to host and prints round trip times. Most of
+ * round trip is spent waking up tapif RX task.
+ *
+ * Built twice: pingbench uses SIGIO wakeups and pingbench-epoll sets
+ * TAPIF_EPOLL (Linux). Creates tap device bench0 (10.9.0.1 on host
+ * side), so it needs CAP_NET_ADMIN. LWIP_SOCKET, LWIP_RAW and
+ * LWIP_SO_RCVTIMEO are needed.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+#include "lwip/tcpip.h"
+#include "lwip/netif.h"
+#include "lwip/sockets.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/icmp.h"
+#include "lwip/prot/ip4.h"
+
+#include "netif/tapif.h"
+
+#if !LWIP_SOCKET || !LWIP_RAW || !LWIP_SO_RCVTIMEO
+#error pingbench needs LWIP_SOCKET, LWIP_RAW and LWIP_SO_RCVTIMEO
+#endif
+
+#ifndef BENCH_PINGS
+#define BENCH_PINGS 1000
+#endif
+
+#ifndef BENCH_STACK_SIZE
+#define BENCH_STACK_SIZE 8192
+#endif
+
+#define PING_ID   0xafaf
+#define PING_DATA 56
+
+#if defined(TAPIF_EPOLL) && TAPIF_EPOLL
+#define WAKEUP "epoll"
+#else
+#define WAKEUP "SIGIO"
+#endif
+
+static struct netif       tapIf;
+static struct tapIfConfig tapConfig;
+
+static u32_t              rtt[BENCH_PINGS];
+
+/*
+ * Add tap interface, runs in tcpip thread.
+ */
+static void benchNetInit(void* arg)
+{
+  ip4_addr_t ip;
+  ip4_addr_t mask;
+  ip4_addr_t gw;
+
+  IP4_ADDR(&ip, 10, 9, 0, 2);
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 10, 9, 0, 1);
+
+  tapConfig.name = "bench0";
+  netif_add(&tapIf, &ip, &mask, &gw, &tapConfig, tapIfInit, tcpip_input);
+  netif_set_default(&tapIf);
+  netif_set_up(&tapIf);
+
+  sys_sem_signal((sys_sem_t*) arg);
+}
+
+static int rttCompare(const void* a, const void* b)
+{
+  u32_t x = *(const u32_t*) a;
+  u32_t y = *(const u32_t*) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Wait for echo reply with given sequence number.
+ */
+static bool pingReply(int s, u16_t seq)
+{
+  char                  reply[sizeof(struct ip_hdr) + 40 + sizeof(struct icmp_echo_hdr) + PING_DATA];
+  struct ip_hdr*        iph;
+  struct icmp_echo_hdr* echo;
+  int                   n;
+
+  while ((n = lwip_recv(s, reply, sizeof(reply), 0)) > 0) {
+
+    iph = (struct ip_hdr*) reply;
+    if (n < IPH_HL_BYTES(iph) + (int) sizeof(struct icmp_echo_hdr))
+      continue;
+
+    echo = (struct icmp_echo_hdr*) (reply + IPH_HL_BYTES(iph));
+    if (ICMPH_TYPE(echo) == ICMP_ER && echo->id == PING_ID && echo->seqno == lwip_htons(seq))
+      return true;
+  }
+
+  return false;
+}
+
+static void pingTest(void)
+{
+  char                  req[sizeof(struct icmp_echo_hdr) + PING_DATA];
+  struct icmp_echo_hdr* echo = (struct icmp_echo_hdr*) req;
+  struct sockaddr_in    addr;
+  struct timeval        tv;
+  uint64_t              sum;
+  uint64_t              t;
+  int                   count;
+  int                   lost;
+  int                   s;
+  int                   i;
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_len         = sizeof(addr);
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = ip4_addr_get_u32(netif_ip4_gw(&tapIf));
+
+  s = lwip_socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+  if (s < 0) {
+
+    nosPrintf("ping: cannot create socket\n");
+    return;
+  }
+
+  tv.tv_sec  = 1;
+  tv.tv_usec = 0;
+  lwip_setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  memset(req, '\0', sizeof(req));
+  for (i = 0; i < PING_DATA; i++)
+    req[sizeof(struct icmp_echo_hdr) + i] = (char) i;
+
+  // First ping resolves host address.
+  count = 0;
+  lost = 0;
+  sum = 0;
+  for (i = 0; i <= BENCH_PINGS; i++) {
+
+    ICMPH_TYPE_SET(echo, ICMP_ECHO);
+    ICMPH_CODE_SET(echo, 0);
+    echo->id     = PING_ID;
+    echo->seqno  = lwip_htons(i);
+    echo->chksum = 0;
+    echo->chksum = inet_chksum(req, sizeof(req));
+
+    t = sys_now_us();
+    if (lwip_sendto(s, req, sizeof(req), 0, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        !pingReply(s, i)) {
+
+      ++lost;
+      continue;
+    }
+
+    t = sys_now_us() - t;
+    if (i > 0) {
+
+      rtt[count++] = t;
+      sum += t;
+    }
+  }
+
+  lwip_close(s);
+  if (count == 0) {
+
+    nosPrintf("ping: no replies\n");
+    return;
+  }
+
+  qsort(rtt, count, sizeof(rtt[0]), rttCompare);
+  nosPrintf("ping rtt   min %lu us, avg %lu us, median %lu us, 99%% %lu us, max %lu us, %d lost\n",
+            (unsigned long) rtt[0],
+            (unsigned long) (sum / count),
+            (unsigned long) rtt[count / 2],
+            (unsigned long) rtt[count * 99 / 100],
+            (unsigned long) rtt[count - 1],
+            lost);
+}
+
+static void benchMain(void* arg)
+{
+  sys_sem_t initDone;
+
+  uosInit();
+
+  sys_sem_new(&initDone, 0);
+  tcpip_init(benchNetInit, &initDone);
+  sys_sem_wait(&initDone);
+
+  nosPrintf("pingbench, %s wakeup, %d pings\n", WAKEUP, BENCH_PINGS);
+  pingTest();
+
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  nosInit(benchMain, NULL, 1, BENCH_STACK_SIZE, 512);
+  return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Protection latency benchmark. A task of higher priority than
+ * tcpip thread sleeps one tick at a time and measures how long
+ * each sleep really takes, first with idle stack and then while
+ * lower priority tasks send UDP packets over pairif. Sleeps get
+ * longer by time the task waits for lwIP to leave protected sections.
+ *
+ * Built twice from port sources: protbench uses scheduler lock
+ * and protbench-mutex sets SYS_ARCH_PROTECT_MUTEX, so lwipopts.h
+ * of application must not set it. LWIP_SOCKET, LWIP_UDP and
+ * LWIP_SO_RCVTIMEO are needed.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+#include "lwip/tcpip.h"
+#include "lwip/netif.h"
+#include "lwip/sockets.h"
+
+#include "netif/pairif.h"
+
+#if !LWIP_SOCKET || !LWIP_UDP || !LWIP_SO_RCVTIMEO
+#error protbench needs LWIP_SOCKET, LWIP_UDP and LWIP_SO_RCVTIMEO
+#endif
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 5
+#endif
+
+#ifndef BENCH_STACK_SIZE
+#define BENCH_STACK_SIZE 8192
+#endif
+
+#ifndef BENCH_PROBE_PRIO
+#define BENCH_PROBE_PRIO (TCPIP_THREAD_PRIO + 1)
+#endif
+
+#define UDP_PORT    5002
+#define UDP_SIZE    256
+#define LOAD_TASKS  2
+
+static struct netif        clientIf;
+static struct netif        serverIf;
+static struct pairIfConfig clientConfig;
+static struct pairIfConfig serverConfig;
+
+static sys_sem_t           ready;
+static sys_sem_t           done;
+static volatile bool       loadRunning;
+static u32_t               loadSent[LOAD_TASKS];
+static u32_t               loadReceived;
+
+static uint64_t            sleepMin;
+static uint64_t            sleepMax;
+static uint64_t            sleepSum;
+static u32_t               sleeps;
+
+static char                buf[UDP_SIZE];
+static char                serverBuf[UDP_SIZE];
+
+/*
+ * Add both interfaces of pair, runs in tcpip thread.
+ */
+static void benchNetInit(void* arg)
+{
+  ip4_addr_t ip;
+  ip4_addr_t mask;
+  ip4_addr_t gw;
+
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 0, 0, 0, 0);
+
+  IP4_ADDR(&ip, 10, 0, 0, 1);
+  netif_add(&clientIf, &ip, &mask, &gw, &clientConfig, pairIfInit, tcpip_input);
+  netif_set_up(&clientIf);
+
+  serverConfig.peer = &clientIf;
+  IP4_ADDR(&ip, 10, 0, 0, 2);
+  netif_add(&serverIf, &ip, &mask, &gw, &serverConfig, pairIfInit, tcpip_input);
+  netif_set_up(&serverIf);
+
+  sys_sem_signal((sys_sem_t*) arg);
+}
+
+static void benchAddr(struct sockaddr_in* addr, struct netif* netif, u16_t port)
+{
+  memset(addr, '\0', sizeof(*addr));
+  addr->sin_len         = sizeof(*addr);
+  addr->sin_family      = AF_INET;
+  addr->sin_port        = lwip_htons(port);
+  addr->sin_addr.s_addr = ip4_addr_get_u32(netif_ip4_addr(netif));
+}
+
+/*
+ * Create UDP socket that sends and receives only through given interface.
+ */
+static int benchSocket(struct netif* netif)
+{
+  struct ifreq ifr;
+  int          s;
+
+  s = lwip_socket(AF_INET, SOCK_DGRAM, 0);
+  if (s < 0)
+    return s;
+
+  memset(&ifr, '\0', sizeof(ifr));
+  netif_index_to_name(netif_get_index(netif), ifr.ifr_name);
+  lwip_setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr));
+  return s;
+}
+
+/*
+ * Sleep one tick at a time for BENCH_SECONDS.
+ */
+static void probe(void* arg)
+{
+  uint64_t t;
+  int      i;
+
+  sleepMin = ~0ULL;
+  sleepMax = 0;
+  sleepSum = 0;
+  sleeps   = 0;
+
+  // Start at tick boundary.
+  posTaskSleep(1);
+  for (i = 0; i < BENCH_SECONDS * HZ; i++) {
+
+    t = sys_now_us();
+    posTaskSleep(1);
+    t = sys_now_us() - t;
+
+    sleepMin = LWIP_MIN(sleepMin, t);
+    sleepMax = LWIP_MAX(sleepMax, t);
+    sleepSum += t;
+    ++sleeps;
+  }
+
+  sys_sem_signal(&done);
+}
+
+static void probeRun(const char* title)
+{
+  nosTaskCreate(probe, NULL, BENCH_PROBE_PRIO, BENCH_STACK_SIZE, "probe");
+  sys_sem_wait(&done);
+
+  nosPrintf("%-6s one tick sleep min %6lu us, avg %6lu us, max %6lu us\n", title,
+            (unsigned long) sleepMin,
+            (unsigned long) (sleepSum / sleeps),
+            (unsigned long) sleepMax);
+}
+
+static void loadServer(void* arg)
+{
+  struct sockaddr_in addr;
+  struct timeval     tv;
+  int                s;
+
+  s = benchSocket(&serverIf);
+  benchAddr(&addr, &serverIf, UDP_PORT);
+  lwip_bind(s, (struct sockaddr*) &addr, sizeof(addr));
+
+  tv.tv_sec  = 0;
+  tv.tv_usec = 500000;
+  lwip_setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  sys_sem_signal(&ready);
+
+  // Stops when clients have been silent for receive timeout.
+  loadReceived = 0;
+  while (lwip_recv(s, serverBuf, sizeof(serverBuf), 0) > 0)
+    ++loadReceived;
+
+  lwip_close(s);
+  sys_sem_signal(&done);
+}
+
+static void loadClient(void* arg)
+{
+  struct sockaddr_in addr;
+  u32_t*             sent = arg;
+  int                s;
+
+  s = benchSocket(&clientIf);
+  benchAddr(&addr, &serverIf, UDP_PORT);
+
+  while (loadRunning)
+    if (lwip_sendto(s, buf, UDP_SIZE, 0, (struct sockaddr*) &addr, sizeof(addr)) > 0)
+      ++*sent;
+
+  lwip_close(s);
+}
+
+static void benchMain(void* arg)
+{
+  sys_sem_t initDone;
+  u32_t     sent;
+  int       i;
+
+  uosInit();
+
+  sys_sem_new(&initDone, 0);
+  sys_sem_new(&ready, 0);
+  sys_sem_new(&done, 0);
+
+  tcpip_init(benchNetInit, &initDone);
+  sys_sem_wait(&initDone);
+
+  nosPrintf("protbench, %s protection, tick %d us, %d s per test\n",
+            SYS_ARCH_PROTECT_MUTEX ? "mutex" : "scheduler lock",
+            1000000 / HZ, BENCH_SECONDS);
+
+  probeRun("idle");
+
+  nosTaskCreate(loadServer, NULL, 1, BENCH_STACK_SIZE, "server");
+  sys_sem_wait(&ready);
+
+  loadRunning = true;
+  for (i = 0; i < LOAD_TASKS; i++)
+    nosTaskCreate(loadClient, &loadSent[i], 1, BENCH_STACK_SIZE, "client");
+
+  probeRun("load");
+
+  loadRunning = false;
+  sys_sem_wait(&done);
+
+  sent = 0;
+  for (i = 0; i < LOAD_TASKS; i++)
+    sent += loadSent[i];
+
+  nosPrintf("load   %lu of %lu udp packets received\n",
+            (unsigned long) loadReceived, (unsigned long) sent);
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  nosInit(benchMain, NULL, 1, BENCH_STACK_SIZE, 512);
+  return 0;
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory interface benchmark. Measures TCP bulk throughput
+ * (with CPU time of sending process per megabyte) and request/response
+ * round trip time between two lwIP processes over shmif, or between
+ * lwIP and host over tapif with "tap" argument.
+ *
+ * In shm mode a peer process is forked before pico]OS is started.
+ * It runs side 1 of shmif (10.8.0.2) with sink and echo servers,
+ * parent runs side 0 (10.8.0.1) and the clients. Peer passes received
+ * frames to stack without copying. In tap mode device bench0 is created
+ * (10.9.0.1 on host side), so it needs CAP_NET_ADMIN.
+ * LWIP_SOCKET and LWIP_TCP are needed.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+#include "lwip/tcpip.h"
+#include "lwip/netif.h"
+#include "lwip/sockets.h"
+
+#include "netif/shmif.h"
+#include "netif/tapif.h"
+#include "benchhost.h"
+
+#if !LWIP_SOCKET || !LWIP_TCP
+#error shmbench needs LWIP_SOCKET and LWIP_TCP
+#endif
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 5
+#endif
+
+#ifndef BENCH_ECHOS
+#define BENCH_ECHOS 1000
+#endif
+
+#ifndef BENCH_STACK_SIZE
+#define BENCH_STACK_SIZE 8192
+#endif
+
+#define BULK_SIZE 8192
+#define ECHO_SIZE 64
+#define SHM_NAME  "/picoos-lwip-bench"
+
+static struct netif       benchIf;
+static struct shmIfConfig shmConfig;
+static struct tapIfConfig tapConfig;
+static bool               tapMode;
+static bool               peer;
+static int                ctlFd;
+static ip4_addr_t         peerAddr;
+
+static char               buf[BULK_SIZE];
+static u32_t              rtt[BENCH_ECHOS];
+
+/*
+ * Add interface, runs in tcpip thread.
+ */
+static void benchNetInit(void* arg)
+{
+  ip4_addr_t ip;
+  ip4_addr_t mask;
+
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  if (tapMode) {
+
+    IP4_ADDR(&ip, 10, 9, 0, 2);
+    IP4_ADDR(&peerAddr, 10, 9, 0, 1);
+
+    tapConfig.name = "bench0";
+    netif_add(&benchIf, &ip, &mask, &peerAddr, &tapConfig, tapIfInit, tcpip_input);
+  }
+  else {
+
+    if (peer) {
+
+      IP4_ADDR(&ip, 10, 8, 0, 2);
+      IP4_ADDR(&peerAddr, 10, 8, 0, 1);
+    }
+    else {
+
+      IP4_ADDR(&ip, 10, 8, 0, 1);
+      IP4_ADDR(&peerAddr, 10, 8, 0, 2);
+    }
+
+    shmConfig.name     = SHM_NAME;
+    shmConfig.side     = peer ? 1 : 0;
+    shmConfig.zeroCopy = 1;
+    netif_add(&benchIf, &ip, &mask, &peerAddr, &shmConfig, shmIfInit, tcpip_input);
+  }
+
+  netif_set_default(&benchIf);
+  netif_set_up(&benchIf);
+
+  sys_sem_signal((sys_sem_t*) arg);
+}
+
+static int peerListen(u16_t port)
+{
+  struct sockaddr_in addr;
+  int                s;
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_len         = sizeof(addr);
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = lwip_htons(port);
+  addr.sin_addr.s_addr = lwip_htonl(INADDR_ANY);
+
+  s = lwip_socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0)
+    return -1;
+
+  if (lwip_bind(s, (struct sockaddr*) &addr, sizeof(addr)) < 0 || lwip_listen(s, 1) < 0) {
+
+    lwip_close(s);
+    return -1;
+  }
+
+  return s;
+}
+
+/*
+ * Echo server of peer process.
+ */
+static void peerEcho(void* arg)
+{
+  char buf[2048];
+  int  ls;
+  int  s;
+  int  n;
+
+  ls = peerListen(BENCH_HOST_ECHO_PORT);
+  if (ls < 0) {
+
+    nosPrintf("peer: cannot listen\n");
+    return;
+  }
+
+  while (true) {
+
+    s = lwip_accept(ls, NULL, NULL);
+    if (s < 0)
+      continue;
+
+    while ((n = lwip_recv(s, buf, sizeof(buf), 0)) > 0)
+      if (lwip_send(s, buf, n, 0) != n)
+        break;
+
+    lwip_close(s);
+  }
+}
+
+/*
+ * Sink server of peer process. Checks data like
+ * host sink does and reports result to parent.
+ */
+static void peerSink(void)
+{
+  struct benchHostResult result;
+  int                    ls;
+  int                    s;
+  int                    n;
+  int                    i;
+
+  ls = peerListen(BENCH_HOST_SINK_PORT);
+  if (ls < 0) {
+
+    nosPrintf("peer: cannot listen\n");
+    return;
+  }
+
+  while (true) {
+
+    s = lwip_accept(ls, NULL, NULL);
+    if (s < 0)
+      continue;
+
+    memset(&result, '\0', sizeof(result));
+    while ((n = lwip_recv(s, buf, sizeof(buf), 0)) > 0) {
+
+      for (i = 0; i < n; i++)
+        if ((uint8_t) buf[i] != (uint8_t) (result.bytes + i))
+          ++result.errors;
+
+      result.bytes += n;
+    }
+
+    lwip_close(s);
+    benchPeerReport(ctlFd, &result);
+  }
+}
+
+/*
+ * Connect to server. Peer process may still be starting,
+ * so retry for a while.
+ */
+static int benchConnect(u16_t port)
+{
+  struct sockaddr_in addr;
+  int                s;
+  int                tries;
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_len         = sizeof(addr);
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = lwip_htons(port);
+  addr.sin_addr.s_addr = ip4_addr_get_u32(&peerAddr);
+
+  for (tries = 0; tries < 50; tries++) {
+
+    s = lwip_socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+      return -1;
+
+    if (lwip_connect(s, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+      return s;
+
+    lwip_close(s);
+    posTaskSleep(MS(100));
+  }
+
+  return -1;
+}
+
+/*
+ * TCP bulk transfer to sink.
+ */
+static void bulkTest(void)
+{
+  struct benchHostResult result;
+  uint64_t               start;
+  uint64_t               elapsed;
+  uint64_t               cpu;
+  int                    s;
+  int                    i;
+
+  s = benchConnect(BENCH_HOST_SINK_PORT);
+  if (s < 0) {
+
+    nosPrintf("tcp bulk: connect failed\n");
+    return;
+  }
+
+  // Buffer size is multiple of 256, so pattern continues over sends.
+  for (i = 0; i < BULK_SIZE; i++)
+    buf[i] = (char) i;
+
+  cpu = benchCpuUs();
+  start = sys_now_us();
+  while (sys_now_us() - start < BENCH_SECONDS * 1000000ULL)
+    if (lwip_send(s, buf, sizeof(buf), 0) < 0)
+      break;
+
+  lwip_close(s);
+  if (!benchHostResult(ctlFd, &result, 10000)) {
+
+    nosPrintf("tcp bulk: no result from sink\n");
+    return;
+  }
+
+  elapsed = sys_now_us() - start;
+  cpu = benchCpuUs() - cpu;
+
+  nosPrintf("tcp bulk   %8lu kbit/s, %lu us cpu per MB, %lu corrupted bytes\n",
+            (unsigned long) (result.bytes * 8000 / elapsed),
+            (unsigned long) (result.bytes > 0 ? cpu * 1048576 / result.bytes : 0),
+            (unsigned long) result.errors);
+}
+
+static int rttCompare(const void* a, const void* b)
+{
+  u32_t x = *(const u32_t*) a;
+  u32_t y = *(const u32_t*) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Send small requests to echo server one at a time.
+ */
+static void echoTest(void)
+{
+  char     req[ECHO_SIZE];
+  uint64_t sum;
+  uint64_t t;
+  int      count;
+  int      got;
+  int      n;
+  int      one = 1;
+  int      s;
+
+  s = benchConnect(BENCH_HOST_ECHO_PORT);
+  if (s < 0) {
+
+    nosPrintf("tcp echo: connect failed\n");
+    return;
+  }
+
+  lwip_setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  memset(req, 'x', sizeof(req));
+
+  sum = 0;
+  for (count = 0; count < BENCH_ECHOS; count++) {
+
+    t = sys_now_us();
+    if (lwip_send(s, req, sizeof(req), 0) != sizeof(req))
+      break;
+
+    for (got = 0; got < ECHO_SIZE; got += n) {
+
+      n = lwip_recv(s, buf, ECHO_SIZE - got, 0);
+      if (n <= 0)
+        break;
+    }
+
+    if (got < ECHO_SIZE)
+      break;
+
+    rtt[count] = sys_now_us() - t;
+    sum += rtt[count];
+  }
+
+  lwip_close(s);
+  if (count == 0) {
+
+    nosPrintf("tcp echo: no replies\n");
+    return;
+  }
+
+  qsort(rtt, count, sizeof(rtt[0]), rttCompare);
+  nosPrintf("tcp echo   min %lu us, avg %lu us, median %lu us, 99%% %lu us, max %lu us, %d requests\n",
+            (unsigned long) rtt[0],
+            (unsigned long) (sum / count),
+            (unsigned long) rtt[count / 2],
+            (unsigned long) rtt[count * 99 / 100],
+            (unsigned long) rtt[count - 1],
+            count);
+}
+
+static void benchMain(void* arg)
+{
+  sys_sem_t initDone;
+
+  uosInit();
+
+  sys_sem_new(&initDone, 0);
+  tcpip_init(benchNetInit, &initDone);
+  sys_sem_wait(&initDone);
+
+  if (peer) {
+
+    sys_thread_new("echo", peerEcho, NULL, BENCH_STACK_SIZE, 1);
+    peerSink();
+    return;
+  }
+
+  nosPrintf("shmbench, %s, %d s\n", tapMode ? "tap" : "shared memory", BENCH_SECONDS);
+  bulkTest();
+  echoTest();
+
+  if (!tapMode) {
+
+    benchPeerStop(ctlFd);
+    shm_unlink(SHM_NAME);
+  }
+
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  tapMode = (argc > 1 && !strcmp(argv[1], "tap"));
+  if (tapMode)
+    ctlFd = benchHostStart();
+  else {
+
+    // Don't inherit ring state from earlier run.
+    shm_unlink(SHM_NAME);
+    ctlFd = benchPeerStart(&peer);
+  }
+
+  if (ctlFd == -1) {
+
+    nosPrintf("cannot start %s process\n", tapMode ? "host" : "peer");
+    return 1;
+  }
+
+  nosInit(benchMain, NULL, 1, BENCH_STACK_SIZE, 512);
+  return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tap TX benchmark. Sends TCP bulk data from lwIP through tapif
+ * to host for BENCH_SECONDS and prints throughput, CPU time of lwIP
+ * process per megabyte and corrupted bytes seen by host.
+ *
+ * Built twice: tapbench sends frames with writev over pbuf chain
+ * and tapbench-copy sets TAPIF_TX_IOV to 0, which copies every frame.
+ * With "offload" argument host completes TCP checksums (virtio-net
+ * headers, Linux with LWIP_CHECKSUM_CTRL_PER_NETIF).
+ * Creates tap device bench0 (10.9.0.1 on host side), so it needs
+ * CAP_NET_ADMIN. LWIP_SOCKET and LWIP_TCP are needed.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+#include "lwip/tcpip.h"
+#include "lwip/netif.h"
+#include "lwip/sockets.h"
+
+#include "netif/tapif.h"
+#include "benchhost.h"
+
+#if !LWIP_SOCKET || !LWIP_TCP
+#error tapbench needs LWIP_SOCKET and LWIP_TCP
+#endif
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 5
+#endif
+
+#ifndef BENCH_STACK_SIZE
+#define BENCH_STACK_SIZE 8192
+#endif
+
+#define BULK_SIZE 8192
+
+#if defined(TAPIF_TX_IOV) && TAPIF_TX_IOV == 0
+#define TX_PATH "copy"
+#else
+#define TX_PATH "writev"
+#endif
+
+static struct netif       tapIf;
+static struct tapIfConfig tapConfig;
+static int                hostFd;
+
+static char               buf[BULK_SIZE];
+
+/*
+ * Add tap interface, runs in tcpip thread.
+ */
+static void benchNetInit(void* arg)
+{
+  ip4_addr_t ip;
+  ip4_addr_t mask;
+  ip4_addr_t gw;
+
+  IP4_ADDR(&ip, 10, 9, 0, 2);
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 10, 9, 0, 1);
+
+  tapConfig.name = "bench0";
+  netif_add(&tapIf, &ip, &mask, &gw, &tapConfig, tapIfInit, tcpip_input);
+  netif_set_default(&tapIf);
+  netif_set_up(&tapIf);
+
+  sys_sem_signal((sys_sem_t*) arg);
+}
+
+/*
+ * TCP bulk transfer from lwIP to host.
+ */
+static void bulkTest(void)
+{
+  struct benchHostResult result;
+  struct sockaddr_in     addr;
+  uint64_t               start;
+  uint64_t               elapsed;
+  uint64_t               cpu;
+  int                    s;
+  int                    i;
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_len         = sizeof(addr);
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = lwip_htons(BENCH_HOST_SINK_PORT);
+  addr.sin_addr.s_addr = ip4_addr_get_u32(netif_ip4_gw(&tapIf));
+
+  s = lwip_socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0 || lwip_connect(s, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+
+    nosPrintf("tcp tx: connect failed\n");
+    return;
+  }
+
+  // Buffer size is multiple of 256, so pattern continues over sends.
+  for (i = 0; i < BULK_SIZE; i++)
+    buf[i] = (char) i;
+
+  cpu = benchCpuUs();
+  start = sys_now_us();
+  while (sys_now_us() - start < BENCH_SECONDS * 1000000ULL)
+    if (lwip_send(s, buf, sizeof(buf), 0) < 0)
+      break;
+
+  lwip_close(s);
+  if (!benchHostResult(hostFd, &result, 10000)) {
+
+    nosPrintf("tcp tx: no result from host\n");
+    return;
+  }
+
+  elapsed = sys_now_us() - start;
+  cpu = benchCpuUs() - cpu;
+
+  nosPrintf("tcp tx     %8lu kbit/s, %lu us cpu per MB, %lu corrupted bytes\n",
+            (unsigned long) (result.bytes * 8000 / elapsed),
+            (unsigned long) (result.bytes > 0 ? cpu * 1048576 / result.bytes : 0),
+            (unsigned long) result.errors);
+}
+
+/*
+ * Tapif turns offload off if host doesn't support it,
+ * report what is really used.
+ */
+static bool offloadActive(void)
+{
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+  return !(tapIf.chksum_flags & NETIF_CHECKSUM_GEN_TCP);
+#else
+  return false;
+#endif
+}
+
+static void benchMain(void* arg)
+{
+  sys_sem_t initDone;
+
+  uosInit();
+
+  sys_sem_new(&initDone, 0);
+  tcpip_init(benchNetInit, &initDone);
+  sys_sem_wait(&initDone);
+
+  nosPrintf("tapbench, %s tx path, checksum offload %s, %d s\n", TX_PATH,
+            offloadActive() ? "on" : "off", BENCH_SECONDS);
+  bulkTest();
+
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && !strcmp(argv[1], "offload"))
+    tapConfig.offload = 1;
+
+  hostFd = benchHostStart();
+  if (hostFd == -1) {
+
+    nosPrintf("cannot start host process\n");
+    return 1;
+  }
+
+  nosInit(benchMain, NULL, 1, BENCH_STACK_SIZE, 512);
+  return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Timer benchmark. Arms BENCH_TIMERS lwIP timeouts with random
+ * expiry times and measures cost of arming, re-arming (cancel and arm,
+ * like TCP does) and cancelling them, and then cost of expiring
+ * them with sys_check_timeouts() while time passes.
+ *
+ * Timeouts are implemented by timer wheel or by lwIP core depending
+ * on SYS_ARCH_TIMER_WHEEL and LWIP_TIMERS_CUSTOM in lwipopts.h of
+ * application, build with both to compare. MEMP_NUM_SYS_TIMEOUT
+ * must have room for BENCH_TIMERS. With timer wheel, cancel cost
+ * grows with timers per SYS_ARCH_TIMER_HASH_SIZE bucket. Stack is
+ * used without tcpip thread, so benchmark task owns lwIP core.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "lwip/opt.h"
+#include "lwip/init.h"
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
+
+#ifndef BENCH_TIMERS
+#define BENCH_TIMERS 10000
+#endif
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 5
+#endif
+
+#ifndef BENCH_STACK_SIZE
+#define BENCH_STACK_SIZE 8192
+#endif
+
+#if !LWIP_TIMERS || MEMP_NUM_SYS_TIMEOUT < BENCH_TIMERS + LWIP_NUM_SYS_TIMEOUT_INTERNAL
+#error timerbench needs LWIP_TIMERS and MEMP_NUM_SYS_TIMEOUT for BENCH_TIMERS
+#endif
+
+#if defined(SYS_ARCH_TIMER_POOL_SIZE) && SYS_ARCH_TIMER_POOL_SIZE < BENCH_TIMERS + LWIP_NUM_SYS_TIMEOUT_INTERNAL
+#error timerbench needs SYS_ARCH_TIMER_POOL_SIZE for BENCH_TIMERS
+#endif
+
+static char  timerArgs[BENCH_TIMERS];
+static u32_t seed = 1;
+static u32_t fired;
+
+/*
+ * Random expiry time in milliseconds, from 1 s to 1 s + BENCH_SECONDS.
+ */
+static u32_t benchExpiry(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return 1000 + (seed >> 8) % (BENCH_SECONDS * 1000);
+}
+
+static void timerFired(void* arg)
+{
+  ++fired;
+}
+
+static void benchResult(const char* title, uint64_t elapsed)
+{
+  nosPrintf("%-8s %8lu ns/timer\n", title,
+            (unsigned long) (elapsed * 1000 / BENCH_TIMERS));
+}
+
+static void timerTest(void)
+{
+  uint64_t start;
+  uint64_t t;
+  uint64_t inCheck;
+  uint64_t maxCheck;
+  u32_t    checks;
+  int      i;
+
+  start = sys_now_us();
+  for (i = 0; i < BENCH_TIMERS; i++)
+    sys_timeout(benchExpiry(), timerFired, &timerArgs[i]);
+
+  benchResult("arm", sys_now_us() - start);
+
+  start = sys_now_us();
+  for (i = 0; i < BENCH_TIMERS; i++) {
+
+    sys_untimeout(timerFired, &timerArgs[i]);
+    sys_timeout(benchExpiry(), timerFired, &timerArgs[i]);
+  }
+
+  benchResult("re-arm", sys_now_us() - start);
+
+  start = sys_now_us();
+  for (i = 0; i < BENCH_TIMERS; i++)
+    sys_untimeout(timerFired, &timerArgs[i]);
+
+  benchResult("cancel", sys_now_us() - start);
+
+  // Expire all, checking timeouts every tick like tcpip thread would.
+  for (i = 0; i < BENCH_TIMERS; i++)
+    sys_timeout(benchExpiry(), timerFired, &timerArgs[i]);
+
+  fired    = 0;
+  inCheck  = 0;
+  maxCheck = 0;
+  checks   = 0;
+  start = sys_now_us();
+  while (fired < BENCH_TIMERS && sys_now_us() - start < (BENCH_SECONDS + 2) * 1000000ULL) {
+
+    posTaskSleep(1);
+
+    t = sys_now_us();
+    sys_check_timeouts();
+    t = sys_now_us() - t;
+
+    inCheck += t;
+    maxCheck = LWIP_MAX(maxCheck, t);
+    ++checks;
+  }
+
+  benchResult("expire", inCheck);
+  nosPrintf("%lu of %d timers expired, %lu checks, max %lu us per check\n",
+            (unsigned long) fired, BENCH_TIMERS,
+            (unsigned long) checks, (unsigned long) maxCheck);
+}
+
+static void benchMain(void* arg)
+{
+  uosInit();
+  lwip_init();
+
+  nosPrintf("timerbench, %s, %d timers\n",
+            SYS_ARCH_TIMER_WHEEL ? "timer wheel" : "lwIP timeout list", BENCH_TIMERS);
+
+  timerTest();
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  nosInit(benchMain, NULL, 1, BENCH_STACK_SIZE, 512);
+  return 0;
+}
@@ -38,42 +38,247 @@
 #include <picoos-u.h>
 
 /*
- * Semaphores map to Pico]OS nano layer api directly.
+ * If SYS_ARCH_STATS is set to 1, semaphores, mutexes and mailboxes
+ * collect wait time histograms, mailbox depth, trypost failures
+ * and mutex hold times. Statistics of objects in use can be queried
+ * by name pattern ("lwip_s*" for semaphores, "lwip_m*" for mutexes,
+ * "lwip_q*" for mailboxes).
  */
+#ifndef SYS_ARCH_STATS
+#define SYS_ARCH_STATS 0
+#endif
+
+#if SYS_ARCH_STATS
+
+#define SYS_ARCH_STATS_BUCKETS 7
+
+typedef struct {
+
+  char  name[20];                         // "lwip_" + kind + up to 10 digits
+  u32_t waits;
+  u32_t timeouts;
+  u32_t waitHist[SYS_ARCH_STATS_BUCKETS]; // < 10 us, < 100 us, ..., >= 1 s
+  u32_t maxWaitUs;
+  u32_t maxHoldUs;
+  u16_t depth;
+  u16_t maxDepth;
+  u32_t postFailures;
+} SysObjStats;
+
+int sys_arch_stats_query(const char* pattern, int first, SysObjStats* out, int max);
+void sys_arch_stats_dump(const char* pattern);
+
+#endif
+
+/*
+ * Semaphores map to Pico]OS nano layer api directly
+ * (or via small wrapper if statistics are collected).
+ */
+#if SYS_ARCH_STATS
+struct SysSem;
+typedef struct SysSem* sys_sem_t;
+#else
 typedef NOSSEMA_t sys_sem_t;
+#endif
 #define sys_sem_valid(sem) (((sem) != NULL) && (*(sem) != NULL))
 #define sys_sem_set_invalid(sem) do { if((sem) != NULL) { *(sem) = NULL; }} while(0)
 
+/*
+ * Netconn semaphores can be per-thread instead of per-netconn.
+ * Semaphore is kept in task control block user space
+ * (POSCFG_TASKCB_USERSPACE must have room for two pointers), unless
+ * SYS_ARCH_TASK_SEM() is defined to point to other task-local storage.
+ * Task that is going to exit should call LWIP_NETCONN_THREAD_SEM_FREE().
+ */
+#if LWIP_NETCONN_SEM_PER_THREAD
+
+sys_sem_t* sys_arch_netconn_sem_get(void);
+void sys_arch_netconn_sem_alloc(void);
+void sys_arch_netconn_sem_free(void);
+
+#define LWIP_NETCONN_THREAD_SEM_GET()   sys_arch_netconn_sem_get()
+#define LWIP_NETCONN_THREAD_SEM_ALLOC() sys_arch_netconn_sem_alloc()
+#define LWIP_NETCONN_THREAD_SEM_FREE()  sys_arch_netconn_sem_free()
+
+#endif
+
 /*
  * Mutexes map to Pico]OS nano layer api directly also (well almost).
  */
+#if SYS_ARCH_STATS
+struct SysMutex;
+typedef struct SysMutex* sys_mutex_t;
+#else
 typedef NOSMUTEX_t sys_mutex_t;
+#endif
 #define sys_mutex_valid(mutex) (((mutex) != NULL) && (*(mutex) != NULL))
 #define sys_mutex_set_invalid(mutex) do { if((mutex) != NULL) { *(mutex) = NULL; }} while(0)
 
 /*
- * Mailbox implementation.
+ * Mailbox implementation. By default mailboxes use picoos-micro
+ * UosRing buffers. If SYS_ARCH_LOCKFREE_MBOX is set to 1 in lwipopts.h,
+ * a lock-free multi-producer/single-consumer ring is used instead.
+ * It requires atomic compare-and-swap support from CPU.
+ */
+#ifndef SYS_ARCH_LOCKFREE_MBOX
+#define SYS_ARCH_LOCKFREE_MBOX 0
+#endif
+
+/*
+ * If SYS_ARCH_MBOX_BATCH is greater than zero, tcpip thread fetches
+ * up to that many messages at once from its mailbox.
+ */
+#ifndef SYS_ARCH_MBOX_BATCH
+#define SYS_ARCH_MBOX_BATCH 0
+#endif
+
+/*
+ * If SYS_ARCH_MBOX_PRIORITY is set to 1, api calls and callbacks
+ * posted to tcpip thread mailbox go to a separate high priority lane
+ * and overtake queued packet input. Lane size is SYS_ARCH_MBOX_HIGH_SIZE,
+ * SYS_ARCH_MBOX_HIGH_BURST limits how many high priority messages
+ * are handled in row while packets are waiting.
+ */
+#ifndef SYS_ARCH_MBOX_PRIORITY
+#define SYS_ARCH_MBOX_PRIORITY 0
+#endif
+
+/*
+ * If SYS_ARCH_MBOX_OVERFLOW is set to 1, behaviour of sys_mbox_post
+ * on a full mailbox can be selected for each mailbox. Default is
+ * to block like before. Drop policies pass dropped message to
+ * callback (if set) so that it can be released. Callback policy
+ * hands new message to callback, which decides what to do with it.
+ *
+ * Note that lwIP core expects sys_mbox_post to always succeed,
+ * so use other policies only for mailboxes whose messages can
+ * be lost safely.
+ */
+#ifndef SYS_ARCH_MBOX_OVERFLOW
+#define SYS_ARCH_MBOX_OVERFLOW 0
+#endif
+
+/*
+ * If SYS_ARCH_OBJECT_POOLS is set to 1, semaphores, mutexes and mailboxes
+ * are taken from fixed-size pools that are filled in sys_init().
+ * Pool sizes are set by SYS_ARCH_SEM_POOL_SIZE, SYS_ARCH_MUTEX_POOL_SIZE,
+ * SYS_ARCH_MBOX_POOL_SIZE and SYS_ARCH_MBOX_POOL_MSGS, defaults are
+ * calculated from MEMP_NUM_NETCONN and mailbox sizes in lwipopts.h.
  */
+#ifndef SYS_ARCH_OBJECT_POOLS
+#define SYS_ARCH_OBJECT_POOLS 0
+#endif
+
+#if SYS_ARCH_OBJECT_POOLS
+
+typedef struct {
+
+  u16_t size;
+  u16_t used;
+  u16_t peak;
+  u32_t failures;
+} SysPoolStats;
+
+void sys_arch_pool_stats(SysPoolStats* sem, SysPoolStats* mutex, SysPoolStats* mbox);
+
+#endif
+
+/*
+ * Without optional features mailbox is UosRing pointer directly,
+ * otherwise a wrapper that holds ring and state of features.
+ */
+#define SYS_ARCH_MBOX_WRAPPER (SYS_ARCH_LOCKFREE_MBOX || SYS_ARCH_STATS || SYS_ARCH_MBOX_PRIORITY || \
+                               SYS_ARCH_MBOX_OVERFLOW || SYS_ARCH_OBJECT_POOLS)
+
+#if SYS_ARCH_MBOX_WRAPPER
+struct SysMbox;
+typedef struct SysMbox* sys_mbox_t;
+#else
 typedef UosRing* sys_mbox_t;
+#endif
 #define sys_mbox_valid(mbox) (((mbox) != NULL) && (*(mbox) != NULL))
 #define sys_mbox_set_invalid(mbox) do { if((mbox) != NULL) { *(mbox) = NULL; }} while(0)
 
+u32_t sys_arch_mbox_fetch_many(sys_mbox_t *mb, void **msgs, int *count, u32_t timeout);
+
+#if SYS_ARCH_MBOX_OVERFLOW
+
+typedef enum {
+
+  SYS_MBOX_OVERFLOW_BLOCK,
+  SYS_MBOX_OVERFLOW_DROP_NEWEST,
+  SYS_MBOX_OVERFLOW_DROP_OLDEST,
+  SYS_MBOX_OVERFLOW_CALLBACK
+} SysMboxOverflow;
+
+typedef void (*SysMboxOverflowFn)(sys_mbox_t *mb, void *msg, void *arg);
+
+typedef struct {
+
+  u32_t posts;
+  u32_t blocked;
+  u32_t droppedNewest;
+  u32_t droppedOldest;
+  u32_t callbacks;
+} SysMboxOverflowStats;
+
+void sys_arch_mbox_set_overflow(sys_mbox_t *mb, SysMboxOverflow policy, SysMboxOverflowFn fn, void *arg);
+void sys_arch_mbox_overflow_stats(sys_mbox_t *mb, SysMboxOverflowStats *st);
+
+#endif
+
 /*
  * Use Pico]OS nano layer thread api.
  */
 typedef NOSTASK_t sys_thread_t;
 
 /*
- * Locking uses interrupt blocking currently.
+ * Locking uses interrupt blocking by default. If SYS_ARCH_PROTECT_MUTEX
+ * is set to 1, a recursive mutex is used instead, so tasks that don't use
+ * lwIP keep running while lwIP is inside protected section.
+ * SYS_ARCH_PROTECT() must not be used from interrupt handlers then.
  */
+#ifndef SYS_ARCH_PROTECT_MUTEX
+#define SYS_ARCH_PROTECT_MUTEX 0
+#endif
 
 typedef POSCFG_LOCK_FLAGSTYPE sys_prot_t;
 
+/*
+ * Monotonic microsecond clock.
+ */
+uint64_t sys_now_us(void);
+
 /*
  * Random numbers.
  */
 void sys_random_init(unsigned short seed);
 int sys_random(void);
 
+/*
+ * If SYS_ARCH_TIMER_WHEEL is set to 1, lwIP timeouts are kept in
+ * a hierarchical timer wheel (timewheel.c) instead of sorted list
+ * in lwIP core. LWIP_TIMERS_CUSTOM must also be set to 1 in lwipopts.h.
+ * Number of timers is limited by SYS_ARCH_TIMER_POOL_SIZE, which
+ * defaults to MEMP_NUM_SYS_TIMEOUT.
+ */
+#ifndef SYS_ARCH_TIMER_WHEEL
+#define SYS_ARCH_TIMER_WHEEL 0
+#endif
+
+/*
+ * If SYS_ARCH_SELFTEST is set to 1, sys_arch_selftest() can be
+ * called to check port internals. It returns 0 if everything is ok.
+ * Clock tests move time seen by sys_now(), so call it before
+ * lwIP is started.
+ */
+#ifndef SYS_ARCH_SELFTEST
+#define SYS_ARCH_SELFTEST 0
+#endif
+
+#if SYS_ARCH_SELFTEST
+int sys_arch_selftest(void);
+#endif
+
 #endif /* LWIP_ARCH_SYS_ARCH_H */
 
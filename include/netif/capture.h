@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include "lwip/opt.h"
+
+/*
+ * If NETIF_CAPTURE is set to 1, drivers copy frames they
+ * receive and send to capture ring after captureStart() has
+ * been called. Otherwise capture hooks compile to nothing.
+ */
+#ifndef NETIF_CAPTURE
+#define NETIF_CAPTURE 0
+#endif
+
+/*
+ * Capture configuration. Frame timestamps are taken from monotonic
+ * sys_now_us(). If wall-clock time is known, it is used to set
+ * if_tsoffset of interfaces in file, so that analyzers show real dates
+ * (with one second accuracy). Otherwise times count from 1970-01-01.
+ */
+struct captureConfig {
+
+  const char* file;        // pcapng file, written through UosFS
+  int         snapLen;     // bytes captured from each frame, 0 for CAPTURE_SNAPLEN (128)
+  int         slots;       // ring slots (power of two), 0 for CAPTURE_SLOTS (64)
+  uint64_t    wallClockUs; // current time in microseconds since 1970, 0 if not known
+};
+
+/*
+ * Capture statistics.
+ */
+struct captureStats {
+
+  u32_t frames;      // frames written to file
+  u32_t overruns;    // frames skipped because ring was full
+  u32_t writeErrors; // frames lost because file write failed
+};
+
+#if NETIF_CAPTURE
+
+err_t captureStart(const struct captureConfig* config);
+err_t captureStats(struct captureStats* stats);
+void captureFrame(struct netif* netif, struct pbuf* p, int tx);
+
+#define NETIF_CAPTURE_FRAME(netif, p, tx) captureFrame(netif, p, tx)
+
+#else
+
+#define NETIF_CAPTURE_FRAME(netif, p, tx)
+
+#endif
+
+#endif /* __CAPTURE_H__ */
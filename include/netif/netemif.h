@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __NETEMIF_H__
+#define __NETEMIF_H__
+
+/*
+ * Link impairment for one direction. Probabilities are
+ * per mille, all zero passes frames through untouched.
+ */
+struct netemIfParams {
+
+  u32_t delay;      // added latency, ms
+  u32_t jitter;     // random variation of latency (+-), ms
+  u16_t loss;       // drop probability
+  u16_t duplicate;  // probability of sending frame twice
+  u16_t reorder;    // probability of sending frame without delay
+  u32_t rate;       // bandwidth limit in bits per second, 0 for unlimited
+};
+
+/*
+ * Impairment configuration. Same random seed
+ * gives same sequence of losses, duplicates and delays.
+ */
+struct netemIfConfig {
+
+  struct netemIfParams out;   // frames sent by stack
+  struct netemIfParams in;    // frames received by driver
+  int                  limit; // max frames queued, 0 for NETEMIF_LIMIT
+  u32_t                seed;  // random seed, 0 for default
+};
+
+/*
+ * Counters for one direction.
+ */
+struct netemIfCounters {
+
+  u32_t frames;     // frames passed to shim
+  u32_t lost;       // frames dropped by loss probability
+  u32_t duplicated; // extra copies sent
+  u32_t reordered;  // frames sent without delay
+  u32_t overLimit;  // frames dropped because queue was full
+  u32_t queued;     // frames currently in delay queue
+};
+
+struct netemIfStats {
+
+  struct netemIfCounters out;
+  struct netemIfCounters in;
+  u32_t                  errors; // frames rejected by driver or original input, or not copied
+};
+
+err_t netemIfAttach(struct netif* netif, const struct netemIfConfig* config);
+err_t netemIfSet(struct netif* netif, const struct netemIfConfig* config);
+err_t netemIfStats(struct netif* netif, struct netemIfStats* stats);
+
+#endif /* __NETEMIF_H__ */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PAIRIF_H__
+#define __PAIRIF_H__
+
+/*
+ * Optional configuration for pair interface. Pass pointer to it
+ * as state argument of netif_add(). First interface of a pair
+ * is added with peer NULL, second one with peer pointing to first.
+ */
+struct pairIfConfig {
+
+  struct netif* peer;     // other interface of pair, NULL if it is added later
+  int           bufs;     // receive buffers, 0 for PAIRIF_BUFS
+};
+
+/*
+ * Statistics of frames received by interface.
+ */
+struct pairIfStats {
+
+  u32_t frames;     // received frames
+  u32_t bytes;      // received bytes
+  u32_t noBufs;     // frames dropped because receive buffers were used
+  u32_t inputDrops; // frames dropped by netif->input (tcpip mailbox full)
+};
+
+err_t pairIfInit(struct netif* netif);
+err_t pairIfStats(struct netif* netif, struct pairIfStats* stats);
+
+#endif /* __PAIRIF_H__ */
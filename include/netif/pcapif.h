@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PCAPIF_H__
+#define __PCAPIF_H__
+
+#define PCAPIF_MAX_RATE 0
+#define PCAPIF_RECORDED 1
+
+/*
+ * Configuration for pcap replay interface. Pass pointer
+ * to it as state argument of netif_add().
+ */
+struct pcapIfConfig {
+
+  const char* file;       // pcap or pcapng file to replay
+  const char* capture;    // pcap file for frames sent by stack, NULL to only count them
+  const u8_t* hwaddr;     // ethernet address, NULL for default
+  int         timing;     // PCAPIF_MAX_RATE or PCAPIF_RECORDED
+  int         passes;     // times to replay file, 0 for once
+};
+
+/*
+ * Statistics of last replay.
+ */
+struct pcapIfStats {
+
+  u32_t frames;     // injected frames
+  u32_t bytes;      // injected bytes
+  u32_t accepted;   // frames accepted by netif->input
+  u32_t drops;      // frames dropped because of empty pbuf pool or input error
+  u32_t outFrames;  // frames sent by stack
+  u32_t outBytes;   // bytes sent by stack
+  u32_t passes;     // completed passes over file
+  u32_t usecs;      // duration of replay in microseconds
+};
+
+err_t pcapIfInit(struct netif* netif);
+err_t pcapIfStart(struct netif* netif);
+err_t pcapIfStats(struct netif* netif, struct pcapIfStats* stats);
+
+#endif /* __PCAPIF_H__ */
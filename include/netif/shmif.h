@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SHMIF_H__
+#define __SHMIF_H__
+
+/*
+ * Optional configuration for shared memory interface. Pass pointer
+ * to it as state argument of netif_add(), or NULL to use defaults.
+ * Processes at both ends must use same name and different side.
+ */
+struct shmIfConfig {
+
+  const char* name;       // POSIX shared memory name, default is "/picoos-lwip"
+  int         side;       // 0 or 1
+  int         zeroCopy;   // 1 to pass received frames to stack without copying, only for trusted peer
+};
+
+/*
+ * Statistics of shared memory interface.
+ */
+struct shmIfStats {
+
+  u32_t wakeups;    // RX task wakeups
+  u32_t frames;     // received frames
+  u32_t bytes;      // received bytes
+  u32_t rxErrors;   // received frames with bad length or buffer index
+  u32_t drops;      // frames dropped because pbuf pool was empty
+  u32_t txFrames;   // sent frames
+  u32_t txDrops;    // frames dropped because TX ring was full
+  u32_t doorbells;  // wakeups sent to other side
+};
+
+err_t shmIfInit(struct netif* netif);
+err_t shmIfStats(struct netif* netif, struct shmIfStats* stats);
+
+#endif /* __SHMIF_H__ */
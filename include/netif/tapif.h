@@ -31,6 +31,53 @@
 #ifndef __TAPIF_H__
 #define __TAPIF_H__
 
+/*
+ * Optional configuration for tap interface. Pass pointer to it
+ * as state argument of netif_add(), or NULL to use defaults.
+ */
+struct tapIfConfig {
+
+  const char* name;       // host interface name, default is "tap0"
+  int         fd;         // already open tap device, 0 if driver should open it
+  int         queues;     // number of IFF_MULTI_QUEUE queues (Linux), 0 or 1 for normal device
+  int         budget;     // receive buffers for each queue, 0 to use pbuf pool
+  int         offload;    // 1 to use virtio-net headers for checksum offload (Linux)
+  int         mtu;        // MTU up to TAPIF_MAX_MTU (9000), 0 for 1500
+  int         pollBudget; // max frames received in one pass, 0 for TAPIF_POLL_BUDGET
+  int         busyPoll;   // busy-poll window in microseconds, 0 for TAPIF_BUSY_POLL, -1 to disable
+  int         txRing;     // frames queued while device is busy, 0 for TAPIF_TX_RING, -1 to disable
+};
+
+/*
+ * Statistics of one device queue.
+ */
+struct tapIfQueueStats {
+
+  u32_t wakeups;    // RX task wakeups
+  u32_t frames;     // received frames
+  u32_t bytes;      // received bytes
+  u32_t drops;      // frames dropped because pbuf pool was empty
+  u32_t starved;    // times queue stopped reading because its budget was used
+  u32_t csumErrors; // frames dropped because of bad TCP or UDP checksum
+  u32_t polls;      // poll passes
+  u32_t overBudget; // passes that used whole poll budget
+  u32_t busyPolls;  // busy-poll windows after traffic
+  u32_t busyFrames; // frames received while busy-polling
+};
+
+/*
+ * Statistics of interface TX ring.
+ */
+struct tapIfTxStats {
+
+  u32_t queued;     // frames queued because device was busy
+  u32_t drops;      // frames dropped because ring was full
+  u32_t occupancy;  // frames in ring now
+  u32_t highWater;  // max frames in ring
+};
+
 err_t tapIfInit(struct netif* netif);
+err_t tapIfQueueStats(struct netif* netif, int queue, struct tapIfQueueStats* stats);
+err_t tapIfTxStats(struct netif* netif, struct tapIfTxStats* stats);
 
 #endif /* __CS8900AIF_H__ */
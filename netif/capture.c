@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Frame capture for network drivers. Drivers copy start of
+ * each received and sent frame into a ring, which is drained to a
+ * pcapng file through UosFS by a low-priority task. Copying
+ * never waits for the writer: when ring is full frame is
+ * counted as overrun and skipped.
+ *
+ * Ring is a bounded queue of sequence-numbered slots like the lock-free
+ * mailbox in sys_arch.c, so drivers running in different tasks can
+ * capture at the same time. On CPUs without compare-and-swap slot is
+ * claimed inside SYS_ARCH_PROTECT instead.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/sys.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+
+#include "netif/capture.h"
+
+#if NETIF_CAPTURE
+
+#include <string.h>
+#include <fcntl.h>
+
+/*
+ * Default bytes captured from each frame.
+ */
+#ifndef CAPTURE_SNAPLEN
+#define CAPTURE_SNAPLEN 128
+#endif
+
+/*
+ * Default number of ring slots, must be power of two.
+ */
+#ifndef CAPTURE_SLOTS
+#define CAPTURE_SLOTS 64
+#endif
+
+/*
+ * Priority of writer task and max time frames wait in ring.
+ */
+#ifndef CAPTURE_PRIORITY
+#define CAPTURE_PRIORITY 1
+#endif
+
+#ifndef CAPTURE_FLUSH_MS
+#define CAPTURE_FLUSH_MS 500
+#endif
+
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4) || defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+#define CAPTURE_CAS 1
+#else
+#define CAPTURE_CAS 0
+#endif
+
+#define PCAPNG_SHB      0x0a0d0d0a
+#define PCAPNG_IDB      1
+#define PCAPNG_EPB      6
+#define PCAPNG_BOM      0x1a2b3c4d
+#define PCAPNG_IF_NAME  2
+#define PCAPNG_IF_TSOFF 14
+#define PCAPNG_EPB_FLAG 2
+#define LINKTYPE_ETHER  1
+#define NO_IF           0xff
+
+typedef struct {
+
+  uintptr_t seq;
+  uint64_t  ts;
+  u16_t     capLen;
+  u16_t     len;
+  u8_t      netifNum;
+  char      name[2];
+  bool      tx;
+  u8_t      data[1];
+} CaptureSlot;
+
+typedef struct {
+
+  char*               slots;
+  int                 slotSize;
+  uintptr_t           mask;
+  uintptr_t           head;
+  uintptr_t           tail;
+  int                 snapLen;
+  bool                wakeup;
+  UosFile*            file;
+  NOSSEMA_t           sema;
+  NOSTASK_t           task;
+  u8_t                ifId[256];
+  u8_t                ifCount;
+  int64_t             tsOffset;
+  struct captureStats stats;
+} Capture;
+
+static Capture* capture;
+
+static inline CaptureSlot* slotAt(uintptr_t pos)
+{
+  return (CaptureSlot*) (capture->slots + (pos & capture->mask) * capture->slotSize);
+}
+
+/*
+ * Claim slot for a frame. Returns NULL if ring is full.
+ */
+static CaptureSlot* slotClaim(uintptr_t* claimed)
+{
+  CaptureSlot* slot;
+  uintptr_t    pos;
+  intptr_t     diff;
+
+#if CAPTURE_CAS
+  pos = __atomic_load_n(&capture->tail, __ATOMIC_RELAXED);
+  while (true) {
+
+    slot = slotAt(pos);
+    diff = (intptr_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+
+      if (__atomic_compare_exchange_n(&capture->tail, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+      return NULL;
+    else
+      pos = __atomic_load_n(&capture->tail, __ATOMIC_RELAXED);
+  }
+#else
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  pos = capture->tail;
+  slot = slotAt(pos);
+  diff = (intptr_t) (slot->seq - pos);
+  if (diff == 0)
+    ++capture->tail;
+
+  SYS_ARCH_UNPROTECT(lev);
+  if (diff != 0)
+    return NULL;
+#endif
+
+  *claimed = pos;
+  return slot;
+}
+
+static inline void slotPublish(CaptureSlot* slot, uintptr_t seq)
+{
+#if CAPTURE_CAS
+  __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+#else
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  slot->seq = seq;
+  SYS_ARCH_UNPROTECT(lev);
+#endif
+}
+
+static inline uintptr_t slotSeq(CaptureSlot* slot)
+{
+#if CAPTURE_CAS
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+#else
+  uintptr_t seq;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  seq = slot->seq;
+  SYS_ARCH_UNPROTECT(lev);
+  return seq;
+#endif
+}
+
+/*
+ * Count frame that didn't fit into ring. Drivers
+ * may do this at the same time like claiming slots.
+ */
+static inline void overrun(void)
+{
+#if CAPTURE_CAS
+  __atomic_fetch_add(&capture->stats.overruns, 1, __ATOMIC_RELAXED);
+#else
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  ++capture->stats.overruns;
+  SYS_ARCH_UNPROTECT(lev);
+#endif
+}
+
+/*
+ * Copy frame into ring. Called by drivers with
+ * padding word (ETH_PAD_SIZE) included in pbuf.
+ */
+void captureFrame(struct netif* netif, struct pbuf* p, int tx)
+{
+  CaptureSlot* slot;
+  uintptr_t    pos;
+
+  if (capture == NULL)
+    return;
+
+  slot = slotClaim(&pos);
+  if (slot == NULL) {
+
+    overrun();
+    return;
+  }
+
+  slot->ts       = sys_now_us();
+  slot->len      = p->tot_len - ETH_PAD_SIZE;
+  slot->capLen   = LWIP_MIN(slot->len, capture->snapLen);
+  slot->netifNum = netif->num;
+  slot->name[0]  = netif->name[0];
+  slot->name[1]  = netif->name[1];
+  slot->tx       = tx;
+  pbuf_copy_partial(p, slot->data, slot->capLen, ETH_PAD_SIZE);
+
+  slotPublish(slot, pos + 1);
+
+  // Wake up writer when ring is half full, otherwise it runs periodically.
+  if (pos - capture->head == (capture->mask + 1) / 2 && !capture->wakeup) {
+
+    capture->wakeup = true;
+    nosSemaSignal(capture->sema);
+  }
+}
+
+static bool writeAll(UosFile* file, const void* data, int len)
+{
+  return len == 0 || uosFileWrite(file, data, len) == len;
+}
+
+static bool writePadded(UosFile* file, const void* data, int len)
+{
+  static const u32_t zero = 0;
+
+  return writeAll(file, data, len) && writeAll(file, &zero, (4 - (len & 3)) & 3);
+}
+
+/*
+ * Block header and trailer. Block length includes both.
+ */
+static bool writeBlockStart(UosFile* file, u32_t type, u32_t bodyLen)
+{
+  u32_t hdr[2];
+
+  hdr[0] = type;
+  hdr[1] = bodyLen + 3 * sizeof(u32_t);
+  return writeAll(file, hdr, sizeof(hdr));
+}
+
+static bool writeBlockEnd(UosFile* file, u32_t bodyLen)
+{
+  u32_t len = bodyLen + 3 * sizeof(u32_t);
+
+  return writeAll(file, &len, sizeof(len));
+}
+
+/*
+ * Write interface description when first frame of netif is seen.
+ * Frame timestamps are from sys_now_us(), if_tsoffset gives
+ * seconds to add to them to get wall-clock time.
+ */
+static bool writeInterface(const CaptureSlot* slot)
+{
+  struct {
+
+    u16_t linkType;
+    u16_t reserved;
+    u32_t snapLen;
+    u16_t nameCode;
+    u16_t nameLen;
+    char  name[4];
+    u16_t tsOffCode;
+    u16_t tsOffLen;
+    u32_t tsOffLow;
+    u32_t tsOffHigh;
+    u32_t end;
+  } idb;
+
+  memset(&idb, '\0', sizeof(idb));
+  idb.linkType = LINKTYPE_ETHER;
+  idb.snapLen  = capture->snapLen;
+  idb.nameCode = PCAPNG_IF_NAME;
+  idb.nameLen  = 3;
+  idb.name[0]  = slot->name[0];
+  idb.name[1]  = slot->name[1];
+  idb.name[2]  = '0' + slot->netifNum % 10;
+
+  idb.tsOffCode = PCAPNG_IF_TSOFF;
+  idb.tsOffLen  = 2 * sizeof(u32_t);
+  idb.tsOffLow  = (uint64_t) capture->tsOffset & 0xffffffff;
+  idb.tsOffHigh = (uint64_t) capture->tsOffset >> 32;
+
+  capture->ifId[slot->netifNum] = capture->ifCount++;
+  return writeBlockStart(capture->file, PCAPNG_IDB, sizeof(idb)) &&
+         writeAll(capture->file, &idb, sizeof(idb)) &&
+         writeBlockEnd(capture->file, sizeof(idb));
+}
+
+/*
+ * Write frame from slot as enhanced packet block.
+ */
+static bool writeFrame(const CaptureSlot* slot)
+{
+  struct {
+
+    u32_t ifId;
+    u32_t tsHigh;
+    u32_t tsLow;
+    u32_t capLen;
+    u32_t len;
+  } epb;
+
+  struct {
+
+    u16_t flagsCode;
+    u16_t flagsLen;
+    u32_t flags;
+    u32_t end;
+  } opt;
+
+  u32_t bodyLen;
+  bool  ok;
+
+  if (capture->ifId[slot->netifNum] == NO_IF && !writeInterface(slot))
+    return false;
+
+  epb.ifId   = capture->ifId[slot->netifNum];
+  epb.tsHigh = slot->ts >> 32;
+  epb.tsLow  = slot->ts & 0xffffffff;
+  epb.capLen = slot->capLen;
+  epb.len    = slot->len;
+
+  // Direction in epb_flags: 1 inbound, 2 outbound.
+  opt.flagsCode = PCAPNG_EPB_FLAG;
+  opt.flagsLen  = sizeof(opt.flags);
+  opt.flags     = slot->tx ? 2 : 1;
+  opt.end       = 0;
+
+  // Options follow padded packet data.
+  bodyLen = sizeof(epb) + ((slot->capLen + 3) & ~3) + sizeof(opt);
+  ok = writeBlockStart(capture->file, PCAPNG_EPB, bodyLen) &&
+       writeAll(capture->file, &epb, sizeof(epb)) &&
+       writePadded(capture->file, slot->data, slot->capLen) &&
+       writeAll(capture->file, &opt, sizeof(opt)) &&
+       writeBlockEnd(capture->file, bodyLen);
+
+  return ok;
+}
+
+/*
+ * Writer task. Frames are written when ring is half
+ * full or CAPTURE_FLUSH_MS has passed.
+ */
+static void captureThread(void* arg)
+{
+  CaptureSlot* slot;
+  int          n;
+
+  while (true) {
+
+    nosSemaWait(capture->sema, MS(CAPTURE_FLUSH_MS));
+    capture->wakeup = false;
+
+    n = 0;
+    while (true) {
+
+      slot = slotAt(capture->head);
+      if (slotSeq(slot) != capture->head + 1)
+        break;
+
+      if (writeFrame(slot))
+        ++capture->stats.frames;
+      else
+        ++capture->stats.writeErrors;
+
+      slotPublish(slot, capture->head + capture->mask + 1);
+      ++capture->head;
+      ++n;
+    }
+
+    if (n > 0)
+      uosFileSync(capture->file);
+  }
+}
+
+/*
+ * Open capture file and start capturing frames from all drivers.
+ */
+err_t captureStart(const struct captureConfig* config)
+{
+  struct {
+
+    u32_t bom;
+    u16_t major;
+    u16_t minor;
+    u32_t sectionLenLow;
+    u32_t sectionLenHigh;
+    u32_t end;
+  } shb;
+
+  Capture*  c;
+  int       slots;
+  uintptr_t i;
+
+  if (capture != NULL)
+    return ERR_INPROGRESS;
+
+  slots = (config->slots > 0) ? config->slots : CAPTURE_SLOTS;
+  if (slots & (slots - 1))
+    return ERR_ARG;
+
+  c = nosMemAlloc(sizeof(Capture));
+  if (c == NULL)
+    return ERR_MEM;
+
+  memset(c, '\0', sizeof(Capture));
+  memset(c->ifId, NO_IF, sizeof(c->ifId));
+  c->snapLen  = (config->snapLen > 0) ? config->snapLen : CAPTURE_SNAPLEN;
+  if (config->wallClockUs > 0)
+    c->tsOffset = (int64_t) (config->wallClockUs - sys_now_us()) / 1000000;
+
+  c->mask     = slots - 1;
+  c->slotSize = LWIP_MEM_ALIGN_SIZE(sizeof(CaptureSlot) - 1 + c->snapLen);
+  c->slots    = nosMemAlloc(slots * c->slotSize);
+  if (c->slots == NULL) {
+
+    nosMemFree(c);
+    return ERR_MEM;
+  }
+
+  c->file = uosFileOpen(config->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (c->file == NULL) {
+
+    nosMemFree(c->slots);
+    nosMemFree(c);
+    return ERR_ARG;
+  }
+
+  memset(&shb, '\0', sizeof(shb));
+  shb.bom            = PCAPNG_BOM;
+  shb.major          = 1;
+  shb.sectionLenLow  = 0xffffffff;
+  shb.sectionLenHigh = 0xffffffff;
+
+  if (!writeBlockStart(c->file, PCAPNG_SHB, sizeof(shb)) ||
+      !writeAll(c->file, &shb, sizeof(shb)) ||
+      !writeBlockEnd(c->file, sizeof(shb))) {
+
+    uosFileClose(c->file);
+    nosMemFree(c->slots);
+    nosMemFree(c);
+    return ERR_IF;
+  }
+
+  for (i = 0; i <= c->mask; i++)
+    ((CaptureSlot*) (c->slots + i * c->slotSize))->seq = i;
+
+  c->sema = nosSemaCreate(0, 0, "capture");
+  c->task = nosTaskCreate(captureThread, NULL, CAPTURE_PRIORITY, 400, "capture");
+
+  // Drivers start copying frames after ring is ready.
+  capture = c;
+  return ERR_OK;
+}
+
+/*
+ * Get capture statistics.
+ */
+err_t captureStats(struct captureStats* stats)
+{
+  if (capture == NULL)
+    return ERR_IF;
+
+  *stats = capture->stats;
+  return ERR_OK;
+}
+
+#endif
@@ -54,6 +54,7 @@
 #include "lpc_reg.h"
 #include "netif/cs8900a_regs.h"
 #include "netif/cs8900aif.h"
+#include "netif/capture.h"
 
 #define IOR                  (1<<12)  // CS8900's ISA-bus interface pins
 #define IOW                  (1<<13)
@@ -348,6 +349,7 @@ static err_t lowLevelOutput(struct netif *netif, struct pbuf *p)
   pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
 
+  NETIF_CAPTURE_FRAME(netif, p, true);
   LINK_STATS_INC(link.xmit);
 
   return ERR_OK;
@@ -404,6 +406,7 @@ static struct pbuf *lowLevelInput(struct netif *netif)
     pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
 
+    NETIF_CAPTURE_FRAME(netif, p, false);
     LINK_STATS_INC(link.recv);
   }
   else {
@@ -0,0 +1,610 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Link impairment shim, in spirit of Linux netem. Attached on top
+ * of any driver after netif_add(), it takes over netif->linkoutput
+ * and netif->input and passes frames to original functions
+ * after applying latency, jitter, loss, reordering,
+ * duplication and bandwidth limit.
+ *
+ * Delayed frames wait in a hashed timer wheel with one millisecond
+ * slots. Wheel is processed in tcpip thread, driven by a single
+ * lwIP timeout armed for next busy slot. Received frames are moved
+ * to tcpip thread with tcpip_inpkt() before they are impaired, so
+ * all shim state is touched only with tcpip core locked.
+ */
+
+#include <picoos.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/sys.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+
+#include "netif/netemif.h"
+
+#if !NO_SYS
+
+/*
+ * Max number of interfaces with shim attached.
+ */
+#ifndef NETEMIF_MAX
+#define NETEMIF_MAX 4
+#endif
+
+/*
+ * Default max number of frames in delay queue.
+ */
+#ifndef NETEMIF_LIMIT
+#define NETEMIF_LIMIT 128
+#endif
+
+// Must be power of two.
+#ifndef NETEMIF_SLOTS
+#define NETEMIF_SLOTS 256
+#endif
+
+#define SLOT_MASK (NETEMIF_SLOTS - 1)
+
+typedef struct NetemFrame {
+
+  struct NetemFrame* next;
+  struct pbuf*       p;
+  u32_t              due;  // ms
+  bool               out;
+} NetemFrame;
+
+typedef struct {
+
+  NetemFrame* head;
+  NetemFrame* tail;
+} NetemSlot;
+
+typedef struct {
+
+  struct netif*        netif;
+  netif_linkoutput_fn  linkoutput;   // original functions
+  netif_input_fn       input;
+  struct netemIfParams out;
+  struct netemIfParams in;
+  uint64_t             outFree;      // link busy until this, us
+  uint64_t             inFree;
+  u32_t                random;
+  NetemFrame*          frames;
+  NetemFrame*          freeList;
+  NetemSlot            slots[NETEMIF_SLOTS];
+  u32_t                busy[NETEMIF_SLOTS / 32];
+  u32_t                wheelNow;     // next ms to process
+  u32_t                timerAt;
+  bool                 timerArmed;
+  struct netemIfStats  stats;
+} NetemIf;
+
+static NetemIf* shims[NETEMIF_MAX];
+
+static const struct netemIfParams noImpairment;
+
+static NetemIf* shimFind(struct netif* netif)
+{
+  int i;
+
+  for (i = 0; i < NETEMIF_MAX; i++)
+    if (shims[i] != NULL && shims[i]->netif == netif)
+      return shims[i];
+
+  return NULL;
+}
+
+/*
+ * Xorshift, so that runs with same seed are repeatable
+ * regardless of LWIP_RAND.
+ */
+static u32_t shimRandom(NetemIf* s)
+{
+  u32_t x = s->random;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  s->random = x;
+  return x;
+}
+
+static bool shimChance(NetemIf* s, u16_t perMille)
+{
+  return perMille > 0 && shimRandom(s) % 1000 < perMille;
+}
+
+/*
+ * Take reference to outgoing frame for queueing. Frames that
+ * point to volatile memory are copied. Returns NULL if out of memory.
+ */
+static struct pbuf* shimHold(struct pbuf* p)
+{
+  struct pbuf* q;
+
+  for (q = p; q != NULL; q = q->next)
+    if (PBUF_NEEDS_COPY(q))
+      return pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+
+  pbuf_ref(p);
+  return p;
+}
+
+/*
+ * Pass frame to original function. Consumes one reference.
+ */
+static void shimDeliver(NetemIf* s, struct pbuf* p, bool out)
+{
+  if (out) {
+
+    if (s->linkoutput(s->netif, p) != ERR_OK)
+      ++s->stats.errors;
+
+    pbuf_free(p);
+    return;
+  }
+
+  if (s->input(p, s->netif) != ERR_OK) {
+
+    ++s->stats.errors;
+    pbuf_free(p);
+  }
+}
+
+static void wheelAdd(NetemIf* s, NetemFrame* f)
+{
+  NetemSlot* slot;
+  int        index;
+
+  if ((int32_t) (f->due - s->wheelNow) < 0)
+    f->due = s->wheelNow;
+
+  index = f->due & SLOT_MASK;
+  slot = &s->slots[index];
+
+  f->next = NULL;
+  if (slot->tail != NULL)
+    slot->tail->next = f;
+  else
+    slot->head = f;
+
+  slot->tail = f;
+  s->busy[index / 32] |= 1UL << (index % 32);
+}
+
+/*
+ * Find next busy slot. Frames further than one wheel
+ * round away make timer fire early, which is harmless.
+ */
+static u32_t wheelNext(NetemIf* s)
+{
+  int   index = s->wheelNow & SLOT_MASK;
+  u32_t n = 0;
+  u32_t bits;
+
+  while (n < NETEMIF_SLOTS) {
+
+    bits = s->busy[index / 32] >> (index % 32);
+    if (bits != 0) {
+
+      while (!(bits & 1)) {
+
+        bits >>= 1;
+        ++n;
+      }
+
+      return s->wheelNow + n;
+    }
+
+    n += 32 - index % 32;
+    index = (index + 32 - index % 32) & SLOT_MASK;
+  }
+
+  return s->wheelNow + NETEMIF_SLOTS;
+}
+
+static void wheelTimer(void* arg);
+
+static void wheelArm(NetemIf* s, u32_t now)
+{
+  u32_t next;
+
+  if (s->stats.out.queued + s->stats.in.queued == 0)
+    return;
+
+  next = wheelNext(s);
+  if (s->timerArmed) {
+
+    if ((int32_t) (next - s->timerAt) >= 0)
+      return;
+
+    sys_untimeout(wheelTimer, s);
+  }
+
+  s->timerArmed = true;
+  s->timerAt = next;
+  sys_timeout((int32_t) (next - now) > 0 ? next - now : 0, wheelTimer, s);
+}
+
+/*
+ * Release all frames that are due. They are collected
+ * to a list first and passed on after wheel has been updated.
+ */
+static void wheelTimer(void* arg)
+{
+  NetemIf*    s = (NetemIf*) arg;
+  NetemFrame* ready = NULL;
+  NetemFrame* readyTail = NULL;
+  NetemFrame* f;
+  NetemFrame* prev;
+  NetemFrame* next;
+  NetemSlot*  slot;
+  u32_t       now = (u32_t) (sys_now_us() / 1000);
+  int         index;
+  int         n;
+
+  s->timerArmed = false;
+
+  for (n = 0; n < NETEMIF_SLOTS && (int32_t) (now - s->wheelNow) >= 0; n++, s->wheelNow++) {
+
+    index = s->wheelNow & SLOT_MASK;
+    if (!(s->busy[index / 32] & (1UL << (index % 32))))
+      continue;
+
+    slot = &s->slots[index];
+    prev = NULL;
+    for (f = slot->head; f != NULL; f = next) {
+
+      next = f->next;
+      if ((int32_t) (f->due - now) > 0) {
+
+        prev = f;
+        continue;
+      }
+
+      if (prev != NULL)
+        prev->next = next;
+      else
+        slot->head = next;
+
+      if (slot->tail == f)
+        slot->tail = prev;
+
+      f->next = NULL;
+      if (readyTail != NULL)
+        readyTail->next = f;
+      else
+        ready = f;
+
+      readyTail = f;
+    }
+
+    if (slot->head == NULL)
+      s->busy[index / 32] &= ~(1UL << (index % 32));
+  }
+
+  if ((int32_t) (now - s->wheelNow) >= 0)
+    s->wheelNow = now + 1;
+
+  while (ready != NULL) {
+
+    f = ready;
+    ready = f->next;
+
+    if (f->out)
+      --s->stats.out.queued;
+    else
+      --s->stats.in.queued;
+
+    f->next = s->freeList;
+    s->freeList = f;
+    shimDeliver(s, f->p, f->out);
+  }
+
+  wheelArm(s, now);
+}
+
+/*
+ * Schedule one copy of frame. Link is modeled as a serializer
+ * running at configured rate, followed by delay and jitter.
+ */
+static void shimQueue(NetemIf* s, struct pbuf* p, bool out, const struct netemIfParams* params)
+{
+  struct netemIfCounters* c = out ? &s->stats.out : &s->stats.in;
+  uint64_t*               linkFree = out ? &s->outFree : &s->inFree;
+  uint64_t                nowUs;
+  uint64_t                dueUs;
+  int32_t                 delay;
+  NetemFrame*             f;
+
+  if (shimChance(s, params->reorder)) {
+
+    ++c->reordered;
+    shimDeliver(s, p, out);
+    return;
+  }
+
+  if (s->freeList == NULL) {
+
+    ++c->overLimit;
+    pbuf_free(p);
+    return;
+  }
+
+  nowUs = sys_now_us();
+  dueUs = nowUs;
+  if (params->rate > 0) {
+
+    if (*linkFree < nowUs)
+      *linkFree = nowUs;
+
+    *linkFree += (uint64_t) p->tot_len * 8 * 1000000 / params->rate;
+    dueUs = *linkFree;
+  }
+
+  delay = params->delay;
+  if (params->jitter > 0)
+    delay += (int32_t) (shimRandom(s) % (2 * params->jitter + 1)) - (int32_t) params->jitter;
+
+  if (delay > 0)
+    dueUs += (uint64_t) delay * 1000;
+
+  // Nothing to wait for and nothing to keep order with.
+  if (dueUs <= nowUs && c->queued == 0) {
+
+    shimDeliver(s, p, out);
+    return;
+  }
+
+  if (s->stats.out.queued + s->stats.in.queued == 0)
+    s->wheelNow = (u32_t) (nowUs / 1000);
+
+  f = s->freeList;
+  s->freeList = f->next;
+
+  f->p   = p;
+  f->out = out;
+  f->due = (u32_t) ((dueUs + 999) / 1000);
+
+  ++c->queued;
+  wheelAdd(s, f);
+  wheelArm(s, (u32_t) (nowUs / 1000));
+}
+
+/*
+ * Apply impairment to frame. Consumes one reference.
+ */
+static void shimImpair(NetemIf* s, struct pbuf* p, bool out)
+{
+  struct netemIfCounters* c = out ? &s->stats.out : &s->stats.in;
+  struct netemIfParams    params;
+  struct pbuf*            dup;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  params = out ? s->out : s->in;
+  SYS_ARCH_UNPROTECT(lev);
+
+  ++c->frames;
+  if (shimChance(s, params.loss)) {
+
+    ++c->lost;
+    pbuf_free(p);
+    return;
+  }
+
+  dup = NULL;
+  if (shimChance(s, params.duplicate)) {
+
+    // Stack modifies received frames, so they must be copied.
+    if (out)
+      dup = shimHold(p);
+    else
+      dup = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+
+    if (dup != NULL)
+      ++c->duplicated;
+  }
+
+  shimQueue(s, p, out, &params);
+  if (dup != NULL)
+    shimQueue(s, dup, out, &params);
+}
+
+static err_t shimOutput(struct netif* netif, struct pbuf* p)
+{
+  NetemIf* s = shimFind(netif);
+
+  LWIP_ASSERT("netemIf: shim not found", s != NULL);
+
+  // Frame may be queued after caller has returned.
+  p = shimHold(p);
+  if (p == NULL) {
+
+    ++s->stats.errors;
+    return ERR_MEM;
+  }
+
+  shimImpair(s, p, true);
+  return ERR_OK;
+}
+
+/*
+ * Runs in tcpip thread.
+ */
+static err_t shimInputCore(struct pbuf* p, struct netif* netif)
+{
+  NetemIf* s = shimFind(netif);
+
+  if (s == NULL)
+    return ERR_IF;
+
+  shimImpair(s, p, false);
+  return ERR_OK;
+}
+
+/*
+ * Called by driver, possibly from its own task.
+ */
+static err_t shimInput(struct pbuf* p, struct netif* netif)
+{
+  NetemIf* s = shimFind(netif);
+  bool     passThru;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  if (s == NULL)
+    return ERR_IF;
+
+  SYS_ARCH_PROTECT(lev);
+  passThru = !memcmp(&s->in, &noImpairment, sizeof(noImpairment));
+  SYS_ARCH_UNPROTECT(lev);
+
+  if (passThru)
+    return s->input(p, netif);
+
+  return tcpip_inpkt(p, netif, shimInputCore);
+}
+
+/*
+ * Attach shim to interface. Must be called after netif_add(),
+ * with tcpip core locked (from tcpip thread, for example).
+ * Config can be NULL, impairment can be set later by netemIfSet().
+ */
+err_t netemIfAttach(struct netif* netif, const struct netemIfConfig* config)
+{
+  NetemIf* s;
+  int      limit;
+  int      slot;
+  int      i;
+
+  LWIP_ASSERT("netif != NULL", (netif != NULL));
+  LWIP_ASSERT_CORE_LOCKED();
+
+  if (shimFind(netif) != NULL)
+    return ERR_VAL;
+
+  for (slot = 0; slot < NETEMIF_MAX; slot++)
+    if (shims[slot] == NULL)
+      break;
+
+  if (slot == NETEMIF_MAX)
+    return ERR_MEM;
+
+  limit = NETEMIF_LIMIT;
+  if (config != NULL && config->limit > 0)
+    limit = config->limit;
+
+  s = nosMemAlloc(sizeof(NetemIf));
+  if (s == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("netemIfAttach: out of memory\n"));
+    return ERR_MEM;
+  }
+
+  memset(s, '\0', sizeof(NetemIf));
+  s->frames = nosMemAlloc(limit * sizeof(NetemFrame));
+  if (s->frames == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("netemIfAttach: out of memory\n"));
+    nosMemFree(s);
+    return ERR_MEM;
+  }
+
+  for (i = 0; i < limit; i++) {
+
+    s->frames[i].next = s->freeList;
+    s->freeList = &s->frames[i];
+  }
+
+  s->random = 0x9e3779b9;
+  if (config != NULL) {
+
+    s->out = config->out;
+    s->in  = config->in;
+    if (config->seed != 0)
+      s->random = config->seed;
+  }
+
+  s->netif      = netif;
+  s->linkoutput = netif->linkoutput;
+  s->input      = netif->input;
+  s->wheelNow   = (u32_t) (sys_now_us() / 1000);
+  shims[slot] = s;
+
+  netif->linkoutput = shimOutput;
+  netif->input      = shimInput;
+  return ERR_OK;
+}
+
+/*
+ * Change impairment of interface. Queued frames keep
+ * their schedule. Random sequence is restarted if seed is set.
+ */
+err_t netemIfSet(struct netif* netif, const struct netemIfConfig* config)
+{
+  NetemIf* s = shimFind(netif);
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  if (s == NULL)
+    return ERR_ARG;
+
+  SYS_ARCH_PROTECT(lev);
+  s->out = config->out;
+  s->in  = config->in;
+  if (config->seed != 0)
+    s->random = config->seed;
+
+  SYS_ARCH_UNPROTECT(lev);
+  return ERR_OK;
+}
+
+/*
+ * Get statistics for interface.
+ */
+err_t netemIfStats(struct netif* netif, struct netemIfStats* stats)
+{
+  NetemIf* s = shimFind(netif);
+
+  if (s == NULL)
+    return ERR_ARG;
+
+  *stats = s->stats;
+  return ERR_OK;
+}
+
+#endif
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loopback pair interface. Two netifs in same process are
+ * connected like with a cable: frame sent to one of them is
+ * passed to input of the other. Stack modifies protocol headers
+ * of received frames in place (byte order swaps in tcp_input,
+ * ICMP replies), so beginning of frame is copied. Rest of frame
+ * is not copied, receiver gets custom pbufs that point to payload
+ * of sent pbufs and hold a reference to them until stack frees
+ * the frame.
+ *
+ * Frames are queued by netif->input of the receiver
+ * (normally tcpip_input, which uses tcpip thread mailbox),
+ * so driver doesn't need a task of its own.
+ */
+
+#include <picoos.h>
+#include <stdbool.h>
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/sys.h"
+#include "lwip/pbuf.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/ethip6.h"
+#include "netif/etharp.h"
+
+#include "netif/pairif.h"
+
+#include <string.h>
+
+/*
+ * Default number of receive buffers. Each pbuf
+ * of a received frame after headers uses one buffer.
+ */
+#ifndef PAIRIF_BUFS
+#define PAIRIF_BUFS 64
+#endif
+
+/*
+ * Bytes copied from beginning of each frame: ethernet header
+ * with VLAN tag, max IPv4 header and max TCP header.
+ */
+#ifndef PAIRIF_COPY_SIZE
+#define PAIRIF_COPY_SIZE (ETH_PAD_SIZE + SIZEOF_ETH_HDR + 4 + 60 + 60)
+#endif
+
+/*
+ * Receive buffer, wraps one pbuf of sent frame.
+ */
+struct pairIf;
+
+struct pairBuf
+{
+  struct pbuf_custom pc;
+  struct pairIf*     pairIf;
+  struct pbuf*       orig;
+  struct pairBuf*    next;
+
+};
+
+/*
+ * Interface-specific data.
+ */
+struct pairIf
+{
+  struct netif*      peer;
+  struct pairBuf*    bufs;
+  struct pairBuf*    free;
+  struct pairIfStats stats;
+
+};
+
+static int pairCount;
+
+/*
+ * Return receive buffer when stack frees the pbuf,
+ * and drop reference to sent pbuf.
+ */
+static void pairBufFree(struct pbuf *p)
+{
+  struct pairBuf *buf = (struct pairBuf*) p;
+  struct pairIf  *pairIf = buf->pairIf;
+  struct pbuf    *orig = buf->orig;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  buf->next = pairIf->free;
+  pairIf->free = buf;
+  SYS_ARCH_UNPROTECT(lev);
+
+  pbuf_free(orig);
+}
+
+/*
+ * Take n receive buffers, all or none.
+ */
+static struct pairBuf *pairBufAlloc(struct pairIf *pairIf, int n)
+{
+  struct pairBuf *bufs;
+  struct pairBuf *buf;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  bufs = NULL;
+
+  SYS_ARCH_PROTECT(lev);
+  while (n > 0 && pairIf->free != NULL) {
+
+    buf = pairIf->free;
+    pairIf->free = buf->next;
+    buf->next = bufs;
+    bufs = buf;
+    --n;
+  }
+
+  if (n > 0) {
+
+    while (bufs != NULL) {
+
+      buf = bufs;
+      bufs = buf->next;
+      buf->next = pairIf->free;
+      pairIf->free = buf;
+    }
+  }
+
+  SYS_ARCH_UNPROTECT(lev);
+  return bufs;
+}
+
+/*
+ * Send packet by passing it to input of peer interface.
+ * Headers are copied to a new pbuf, and each pbuf of chain
+ * after them is wrapped into receive buffer of peer.
+ * Peer may hold frame for long (out of order segments, unread
+ * datagrams), so volatile PBUF_REF/ROM payloads are copied first.
+ */
+static err_t lowLevelOutput(struct netif *netif, struct pbuf *p)
+{
+  struct pairIf  *pairIf = netif->state;
+  struct netif   *peer = pairIf->peer;
+  struct pairIf  *peerIf;
+  struct pairBuf *bufs;
+  struct pairBuf *buf;
+  struct pbuf    *head;
+  struct pbuf    *copy;
+  struct pbuf    *q;
+  u16_t          hdrLen;
+  u16_t          offset;
+  u16_t          len;
+  int            count;
+
+  if (peer == NULL) {
+
+    LINK_STATS_INC(link.drop);
+    return ERR_IF;
+  }
+
+  peerIf = peer->state;
+
+  copy = NULL;
+  for (q = p; q != NULL; q = q->next)
+    if (PBUF_NEEDS_COPY(q))
+      break;
+
+  if (q != NULL) {
+
+    copy = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+    if (copy == NULL) {
+
+      LINK_STATS_INC(link.memerr);
+      LINK_STATS_INC(link.drop);
+      return ERR_MEM;
+    }
+
+    p = copy;
+  }
+
+  hdrLen = LWIP_MIN(p->tot_len, PAIRIF_COPY_SIZE);
+
+  // Count pbufs that have data after headers.
+  count = 0;
+  offset = hdrLen;
+  for (q = p; q != NULL; q = q->next) {
+
+    if (offset >= q->len)
+      offset -= q->len;
+    else {
+
+      offset = 0;
+      ++count;
+    }
+  }
+
+  head = pbuf_alloc(PBUF_RAW, hdrLen, PBUF_RAM);
+  bufs = NULL;
+  if (head != NULL && count > 0) {
+
+    bufs = pairBufAlloc(peerIf, count);
+    if (bufs == NULL) {
+
+      ++peerIf->stats.noBufs;
+      pbuf_free(head);
+      head = NULL;
+    }
+  }
+
+  if (head == NULL) {
+
+    if (copy != NULL)
+      pbuf_free(copy);
+
+    LINK_STATS_INC(link.memerr);
+    LINK_STATS_INC(link.drop);
+    return ERR_MEM;
+  }
+
+  pbuf_copy_partial(p, head->payload, hdrLen, 0);
+
+  offset = hdrLen;
+  for (q = p; q != NULL; q = q->next) {
+
+    if (offset >= q->len) {
+
+      offset -= q->len;
+      continue;
+    }
+
+    buf = bufs;
+    bufs = buf->next;
+
+    pbuf_ref(q);
+    buf->pairIf = peerIf;
+    buf->orig   = q;
+    buf->pc.custom_free_function = pairBufFree;
+    pbuf_cat(head, pbuf_alloced_custom(PBUF_RAW, q->len - offset, PBUF_REF, &buf->pc,
+                                       (u8_t*) q->payload + offset, q->len - offset));
+    offset = 0;
+  }
+
+  // Receive buffers hold the copy now.
+  if (copy != NULL)
+    pbuf_free(copy);
+
+  LINK_STATS_INC(link.xmit);
+
+  // Frame belongs to peer after input.
+  len = head->tot_len;
+  if (peer->input(head, peer) != ERR_OK) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("pairIf: input error\n"));
+    ++peerIf->stats.inputDrops;
+    LINK_STATS_INC(link.drop);
+    pbuf_free(head);
+    return ERR_OK;
+  }
+
+  ++peerIf->stats.frames;
+  peerIf->stats.bytes += len;
+  LINK_STATS_INC(link.recv);
+  return ERR_OK;
+}
+
+/*
+ * Initialize interface.
+ */
+err_t pairIfInit(struct netif *netif)
+{
+  const struct pairIfConfig *config;
+  struct pairIf  *pairIf;
+  struct pairIf  *peerIf;
+  struct pairBuf *buf;
+  int            bufCount;
+  int            i;
+
+  LWIP_ASSERT("netif != NULL", (netif != NULL));
+
+  config = netif->state;
+
+  bufCount = PAIRIF_BUFS;
+  if (config != NULL && config->bufs > 0)
+    bufCount = config->bufs;
+
+  pairIf = mem_malloc(sizeof(struct pairIf));
+  if (pairIf == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("pairIfInit: out of memory\n"));
+    return ERR_MEM;
+  }
+
+  memset(pairIf, '\0', sizeof(struct pairIf));
+  pairIf->bufs = nosMemAlloc(bufCount * sizeof(struct pairBuf));
+  if (pairIf->bufs == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("pairIfInit: out of memory\n"));
+    mem_free(pairIf);
+    return ERR_MEM;
+  }
+
+  for (i = 0; i < bufCount; i++) {
+
+    buf = &pairIf->bufs[i];
+    buf->next = pairIf->free;
+    pairIf->free = buf;
+  }
+
+#if LWIP_NETIF_HOSTNAME
+  netif->hostname = "lwip";
+#endif
+
+  NETIF_INIT_SNMP(netif, snmp_ifType_ethernet_csmacd, 10000000);
+
+  netif->state = pairIf;
+  netif->name[0] = 'p';
+  netif->name[1] = 'r';
+  netif->output = etharp_output;
+
+#if LWIP_IPV6
+  netif->output_ip6 = ethip6_output;
+#endif
+
+  netif->linkoutput = lowLevelOutput;
+
+  // Locally administered ethernet address
+  netif->hwaddr_len = ETHARP_HWADDR_LEN;
+  netif->hwaddr[0] = 0x2;
+  netif->hwaddr[1] = 0xbd;
+  netif->hwaddr[2] = 0x3;
+  netif->hwaddr[3] = 0x4;
+  netif->hwaddr[4] = 0x5;
+  netif->hwaddr[5] = 0x6 + pairCount;
+
+  netif->mtu = 1500;
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+
+  // Second interface of pair connects both.
+  if (config != NULL && config->peer != NULL) {
+
+    peerIf = config->peer->state;
+    LWIP_ASSERT("peer already connected", peerIf->peer == NULL);
+
+    pairIf->peer = config->peer;
+    peerIf->peer = netif;
+  }
+
+  ++pairCount;
+  return ERR_OK;
+}
+
+/*
+ * Get statistics for interface.
+ */
+err_t pairIfStats(struct netif *netif, struct pairIfStats *stats)
+{
+  struct pairIf *pairIf = netif->state;
+
+  *stats = pairIf->stats;
+  return ERR_OK;
+}
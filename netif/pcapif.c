@@ -0,0 +1,700 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Pcap replay interface. Frames from a pcap or pcapng file are
+ * loaded into memory once and passed to netif->input by a task,
+ * either as fast as possible or at recorded timestamps. Frames sent
+ * by stack are counted and optionally written to a pcap file.
+ *
+ * Only Ethernet frames are replayed. Replay is started
+ * with pcapIfStart() after stack has been set up.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdbool.h>
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/sys.h"
+#include "lwip/pbuf.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/ethip6.h"
+#include "netif/etharp.h"
+
+#include "netif/pcapif.h"
+
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+
+/*
+ * Frames injected between yields when replaying at max rate.
+ */
+#ifndef PCAPIF_POLL_BUDGET
+#define PCAPIF_POLL_BUDGET 64
+#endif
+
+#define PCAP_MAGIC       0xa1b2c3d4
+#define PCAP_MAGIC_NS    0xa1b23c4d
+#define PCAPNG_SHB       0x0a0d0d0a
+#define PCAPNG_IDB       1
+#define PCAPNG_SPB       3
+#define PCAPNG_EPB       6
+#define PCAPNG_BOM       0x1a2b3c4d
+#define PCAPNG_TSRESOL   9
+#define PCAPNG_MAX_IF    8
+#define LINKTYPE_ETHER   1
+
+/*
+ * Header of classic pcap file and record.
+ */
+struct pcapHdr
+{
+  u32_t magic;
+  u16_t major;
+  u16_t minor;
+  s32_t zone;
+  u32_t sigfigs;
+  u32_t snapLen;
+  u32_t linkType;
+
+};
+
+struct pcapRec
+{
+  u32_t sec;
+  u32_t usec;
+  u32_t capLen;
+  u32_t len;
+
+};
+
+/*
+ * Frame in loaded file, timestamp is in microseconds.
+ */
+struct pcapFrame
+{
+  u32_t    offset;
+  u16_t    len;
+  uint64_t ts;
+
+};
+
+/*
+ * Interface-specific data.
+ */
+struct pcapIf
+{
+  struct netif*      netif;
+  char*              data;
+  struct pcapFrame*  frames;
+  int                frameCount;
+  int                timing;
+  int                passes;
+  UosFile*           capture;
+  char*              txCopy;
+  NOSSEMA_t          sema;
+  NOSTASK_t          task;
+  bool               running;
+  struct pcapIfStats stats;
+
+};
+
+static u32_t get32(const char *p, bool swap)
+{
+  u32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+static u16_t get16(const char *p, bool swap)
+{
+  u16_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return swap ? __builtin_bswap16(v) : v;
+}
+
+/*
+ * Convert pcapng timestamp to microseconds. Resolution must
+ * have been checked with validResol().
+ */
+static uint64_t tsMicros(uint64_t ts, u8_t resol)
+{
+  uint64_t units;
+  uint64_t secs;
+  uint64_t frac;
+  int      i;
+
+  if (resol & 0x80) {
+
+    resol &= 0x7f;
+    secs = ts >> resol;
+    frac = ts & ((1ULL << resol) - 1);
+
+    // Fraction times 10^6 must fit in 64 bits, drop bits below microsecond.
+    if (resol > 44) {
+
+      frac >>= resol - 44;
+      resol = 44;
+    }
+
+    return secs * 1000000 + ((frac * 1000000) >> resol);
+  }
+
+  units = 1;
+  for (i = 0; i < resol; i++)
+    units *= 10;
+
+  if (units >= 1000000)
+    return ts / (units / 1000000);
+
+  return ts * (1000000 / units);
+}
+
+/*
+ * Check if_tsresol option value. Units must fit in 64 bits.
+ */
+static bool validResol(u8_t resol)
+{
+  if (resol & 0x80)
+    return (resol & 0x7f) < 64;
+
+  return resol <= 19;
+}
+
+/*
+ * Add frame to index. When index is NULL frames are only counted.
+ */
+static void addFrame(struct pcapIf *pcapIf, struct pcapFrame *index, int *count,
+                     u32_t offset, u32_t len, uint64_t ts)
+{
+  if (len < SIZEOF_ETH_HDR || len > SIZEOF_ETH_HDR + pcapIf->netif->mtu)
+    return;
+
+  if (index != NULL) {
+
+    index[*count].offset = offset;
+    index[*count].len    = len;
+    index[*count].ts     = ts;
+  }
+
+  ++*count;
+}
+
+/*
+ * Parse classic pcap file. Returns number of frames or -1.
+ */
+static int parsePcap(struct pcapIf *pcapIf, u32_t size, struct pcapFrame *index)
+{
+  const char *data = pcapIf->data;
+  u32_t      magic;
+  u32_t      offset;
+  u32_t      len;
+  uint64_t   ts;
+  bool       swap;
+  bool       nsec;
+  int        count;
+
+  magic = get32(data, false);
+  swap  = (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS));
+  nsec  = (get32(data, swap) == PCAP_MAGIC_NS);
+
+  if (size < sizeof(struct pcapHdr) ||
+      get32(data + offsetof(struct pcapHdr, linkType), swap) != LINKTYPE_ETHER)
+    return -1;
+
+  count = 0;
+  for (offset = sizeof(struct pcapHdr);
+       offset + sizeof(struct pcapRec) <= size;
+       offset += sizeof(struct pcapRec) + len) {
+
+    len = get32(data + offset + offsetof(struct pcapRec, capLen), swap);
+    if (len > size - offset - sizeof(struct pcapRec))
+      break;
+
+    ts = (uint64_t) get32(data + offset + offsetof(struct pcapRec, sec), swap) * 1000000;
+    ts += get32(data + offset + offsetof(struct pcapRec, usec), swap) / (nsec ? 1000 : 1);
+    addFrame(pcapIf, index, &count, offset + sizeof(struct pcapRec), len, ts);
+  }
+
+  return count;
+}
+
+/*
+ * Parse pcapng file. Returns number of frames or -1.
+ */
+static int parsePcapng(struct pcapIf *pcapIf, u32_t size, struct pcapFrame *index)
+{
+  const char *data = pcapIf->data;
+  const char *block;
+  u16_t      linkType[PCAPNG_MAX_IF];
+  u8_t       tsResol[PCAPNG_MAX_IF];
+  int        ifCount;
+  u32_t      offset;
+  u32_t      type;
+  u32_t      blockLen;
+  u32_t      ifId;
+  u32_t      len;
+  u32_t      opt;
+  uint64_t   ts;
+  bool       swap;
+  int        count;
+
+  swap = false;
+  ifCount = 0;
+  count = 0;
+  ts = 0;
+
+  for (offset = 0; offset + 12 <= size; offset += blockLen) {
+
+    block = data + offset;
+    type  = get32(block, swap);
+
+    // Section header sets byte order for rest of section.
+    if (type == PCAPNG_SHB) {
+
+      if (offset + 16 > size)
+        break;
+
+      swap = (get32(block + 8, false) != PCAPNG_BOM);
+      ifCount = 0;
+    }
+
+    blockLen = get32(block + 4, swap);
+    if (blockLen < 12 || blockLen > size - offset || (blockLen & 3))
+      return (offset == 0) ? -1 : count;
+
+    switch (type) {
+    case PCAPNG_IDB:
+      if (ifCount == PCAPNG_MAX_IF || blockLen < 20)
+        break;
+
+      linkType[ifCount] = get16(block + 8, swap);
+      tsResol[ifCount] = 6;
+      for (opt = 16; opt + 4 <= blockLen - 4; opt += 4 + ((get16(block + opt + 2, swap) + 3) & ~3)) {
+
+        if (get16(block + opt, swap) == 0)
+          break;
+
+        if (get16(block + opt, swap) == PCAPNG_TSRESOL)
+          tsResol[ifCount] = block[opt + 4];
+      }
+
+      // Timestamps cannot be converted, skip frames of interface.
+      if (!validResol(tsResol[ifCount]))
+        linkType[ifCount] = 0;
+
+      ++ifCount;
+      break;
+
+    case PCAPNG_EPB:
+      if (blockLen < 32)
+        break;
+
+      ifId = get32(block + 8, swap);
+      len  = get32(block + 20, swap);
+      if (ifId >= (u32_t) ifCount || linkType[ifId] != LINKTYPE_ETHER || len > blockLen - 32)
+        break;
+
+      ts = ((uint64_t) get32(block + 12, swap) << 32) | get32(block + 16, swap);
+      ts = tsMicros(ts, tsResol[ifId]);
+      addFrame(pcapIf, index, &count, offset + 28, len, ts);
+      break;
+
+    case PCAPNG_SPB:
+      // Simple packet has no timestamp, use previous one.
+      if (blockLen < 16 || ifCount == 0 || linkType[0] != LINKTYPE_ETHER)
+        break;
+
+      len = LWIP_MIN(get32(block + 8, swap), blockLen - 16);
+      addFrame(pcapIf, index, &count, offset + 12, len, ts);
+      break;
+    }
+  }
+
+  return count;
+}
+
+static int parse(struct pcapIf *pcapIf, u32_t size, struct pcapFrame *index)
+{
+  u32_t magic;
+
+  if (size < 4)
+    return -1;
+
+  magic = get32(pcapIf->data, false);
+  if (magic == PCAPNG_SHB)
+    return parsePcapng(pcapIf, size, index);
+
+  if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS ||
+      magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS))
+    return parsePcap(pcapIf, size, index);
+
+  return -1;
+}
+
+/*
+ * Load file into memory and build frame index.
+ */
+static err_t load(struct pcapIf *pcapIf, const char *fileName)
+{
+  UosFile     *file;
+  UosFileInfo st;
+  int         len;
+  int         n;
+
+  file = uosFileOpen(fileName, O_RDONLY, 0);
+  if (file == NULL)
+    return ERR_ARG;
+
+  if (uosFileFStat(file, &st) == -1 || st.size <= 0) {
+
+    uosFileClose(file);
+    return ERR_ARG;
+  }
+
+  pcapIf->data = nosMemAlloc(st.size);
+  if (pcapIf->data == NULL) {
+
+    uosFileClose(file);
+    return ERR_MEM;
+  }
+
+  for (len = 0; len < st.size; len += n) {
+
+    n = uosFileRead(file, pcapIf->data + len, st.size - len);
+    if (n <= 0)
+      break;
+  }
+
+  uosFileClose(file);
+
+  pcapIf->frameCount = parse(pcapIf, len, NULL);
+  if (pcapIf->frameCount <= 0)
+    return ERR_ARG;
+
+  pcapIf->frames = nosMemAlloc(pcapIf->frameCount * sizeof(struct pcapFrame));
+  if (pcapIf->frames == NULL)
+    return ERR_MEM;
+
+  parse(pcapIf, len, pcapIf->frames);
+  return ERR_OK;
+}
+
+/*
+ * Write pcap file header for captured frames.
+ */
+static UosFile *captureOpen(const char *fileName)
+{
+  UosFile        *file;
+  struct pcapHdr hdr;
+
+  file = uosFileOpen(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file == NULL)
+    return NULL;
+
+  memset(&hdr, '\0', sizeof(hdr));
+  hdr.magic    = PCAP_MAGIC;
+  hdr.major    = 2;
+  hdr.minor    = 4;
+  hdr.snapLen  = 65535;
+  hdr.linkType = LINKTYPE_ETHER;
+
+  if (uosFileWrite(file, (const char*) &hdr, sizeof(hdr)) != sizeof(hdr)) {
+
+    uosFileClose(file);
+    return NULL;
+  }
+
+  return file;
+}
+
+/*
+ * Frame sent by stack. It is counted and written
+ * to capture file if there is one.
+ */
+static err_t lowLevelOutput(struct netif *netif, struct pbuf *p)
+{
+  struct pcapIf  *pcapIf = netif->state;
+  struct pcapRec rec;
+  uint64_t       now;
+  u16_t          len;
+
+  len = p->tot_len - ETH_PAD_SIZE;
+  ++pcapIf->stats.outFrames;
+  pcapIf->stats.outBytes += len;
+  LINK_STATS_INC(link.xmit);
+
+  if (pcapIf->capture == NULL)
+    return ERR_OK;
+
+  now = sys_now_us();
+  rec.sec    = now / 1000000;
+  rec.usec   = now % 1000000;
+  rec.capLen = len;
+  rec.len    = len;
+
+  pbuf_copy_partial(p, pcapIf->txCopy, len, ETH_PAD_SIZE);
+  uosFileWrite(pcapIf->capture, (const char*) &rec, sizeof(rec));
+  uosFileWrite(pcapIf->capture, pcapIf->txCopy, len);
+  return ERR_OK;
+}
+
+/*
+ * Pass one frame to stack.
+ */
+static void inject(struct pcapIf *pcapIf, const struct pcapFrame *frame)
+{
+  struct netif *netif = pcapIf->netif;
+  struct pbuf  *p;
+
+  ++pcapIf->stats.frames;
+  pcapIf->stats.bytes += frame->len;
+
+  p = pbuf_alloc(PBUF_RAW, frame->len + ETH_PAD_SIZE, PBUF_POOL);
+  if (p == NULL) {
+
+    ++pcapIf->stats.drops;
+    LINK_STATS_INC(link.memerr);
+    LINK_STATS_INC(link.drop);
+    return;
+  }
+
+#if ETH_PAD_SIZE
+  pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
+#endif
+
+  pbuf_take(p, pcapIf->data + frame->offset, frame->len);
+
+#if ETH_PAD_SIZE
+  pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
+
+  LINK_STATS_INC(link.recv);
+  if (netif->input(p, netif) != ERR_OK) {
+
+    ++pcapIf->stats.drops;
+    LINK_STATS_INC(link.drop);
+    pbuf_free(p);
+    return;
+  }
+
+  ++pcapIf->stats.accepted;
+}
+
+/*
+ * Wait until given time. Task sleeps for whole ticks
+ * and yields for the rest.
+ */
+static void waitUntil(uint64_t deadline)
+{
+  uint64_t now;
+
+  now = sys_now_us();
+  if (deadline > now + 2000)
+    posTaskSleep(MS((deadline - now) / 1000 - 1));
+
+  while (sys_now_us() < deadline)
+    posTaskYield();
+}
+
+/*
+ * Replay task.
+ */
+static void pcapThread(void* arg)
+{
+  struct pcapIf    *pcapIf = (struct pcapIf*) arg;
+  struct pcapFrame *frame;
+  uint64_t         start;
+  uint64_t         passStart;
+  int64_t          delta;
+  int              pass;
+  int              i;
+
+  while (true) {
+
+    nosSemaWait(pcapIf->sema, INFINITE);
+
+    start = sys_now_us();
+    for (pass = 0; pass < pcapIf->passes; pass++) {
+
+      passStart = sys_now_us();
+      for (i = 0; i < pcapIf->frameCount; i++) {
+
+        frame = &pcapIf->frames[i];
+        if (pcapIf->timing == PCAPIF_RECORDED) {
+
+          // Timestamps are not always in order, don't wait for earlier ones.
+          delta = (int64_t) (frame->ts - pcapIf->frames[0].ts);
+          waitUntil(passStart + (delta > 0 ? delta : 0));
+        }
+        else if (i % PCAPIF_POLL_BUDGET == PCAPIF_POLL_BUDGET - 1)
+          posTaskYield();
+
+        inject(pcapIf, frame);
+      }
+
+      ++pcapIf->stats.passes;
+    }
+
+    pcapIf->stats.usecs = sys_now_us() - start;
+    pcapIf->running = false;
+  }
+}
+
+/*
+ * Initialize interface.
+ */
+err_t pcapIfInit(struct netif *netif)
+{
+  const struct pcapIfConfig *config;
+  struct pcapIf *pcapIf;
+  err_t         err;
+
+  LWIP_ASSERT("netif != NULL", (netif != NULL));
+
+  config = netif->state;
+  if (config == NULL || config->file == NULL)
+    return ERR_ARG;
+
+  pcapIf = mem_malloc(sizeof(struct pcapIf));
+  if (pcapIf == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("pcapIfInit: out of memory\n"));
+    return ERR_MEM;
+  }
+
+  memset(pcapIf, '\0', sizeof(struct pcapIf));
+  pcapIf->netif  = netif;
+  pcapIf->timing = config->timing;
+  pcapIf->passes = (config->passes > 0) ? config->passes : 1;
+
+  netif->mtu = 1500;
+
+  err = load(pcapIf, config->file);
+  if (err == ERR_OK && config->capture != NULL) {
+
+    pcapIf->txCopy = nosMemAlloc(SIZEOF_ETH_HDR + netif->mtu);
+    if (pcapIf->txCopy == NULL)
+      err = ERR_MEM;
+    else {
+
+      pcapIf->capture = captureOpen(config->capture);
+      if (pcapIf->capture == NULL)
+        err = ERR_ARG;
+    }
+  }
+
+  if (err != ERR_OK) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("pcapIfInit: cannot load %s\n", config->file));
+    if (pcapIf->data != NULL)
+      nosMemFree(pcapIf->data);
+
+    if (pcapIf->frames != NULL)
+      nosMemFree(pcapIf->frames);
+
+    if (pcapIf->txCopy != NULL)
+      nosMemFree(pcapIf->txCopy);
+
+    mem_free(pcapIf);
+    return err;
+  }
+
+#if LWIP_NETIF_HOSTNAME
+  netif->hostname = "lwip";
+#endif
+
+  NETIF_INIT_SNMP(netif, snmp_ifType_ethernet_csmacd, 10000000);
+
+  netif->state = pcapIf;
+  netif->name[0] = 'p';
+  netif->name[1] = 'c';
+  netif->output = etharp_output;
+
+#if LWIP_IPV6
+  netif->output_ip6 = ethip6_output;
+#endif
+
+  netif->linkoutput = lowLevelOutput;
+
+  // Replayed frames are usually sent to address of capturing host.
+  netif->hwaddr_len = ETHARP_HWADDR_LEN;
+  if (config->hwaddr != NULL)
+    memcpy(netif->hwaddr, config->hwaddr, ETHARP_HWADDR_LEN);
+  else {
+
+    netif->hwaddr[0] = 0x2;
+    netif->hwaddr[1] = 0xbd;
+    netif->hwaddr[2] = 0x3;
+    netif->hwaddr[3] = 0x4;
+    netif->hwaddr[4] = 0x7;
+    netif->hwaddr[5] = 0x6;
+  }
+
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+
+  pcapIf->sema = nosSemaCreate(0, 0, "pcap");
+  pcapIf->task = nosTaskCreate(pcapThread, pcapIf, 10, 300, "pcapif");
+  return ERR_OK;
+}
+
+/*
+ * Start replay. Statistics are cleared.
+ */
+err_t pcapIfStart(struct netif *netif)
+{
+  struct pcapIf *pcapIf = netif->state;
+
+  if (pcapIf->running)
+    return ERR_INPROGRESS;
+
+  memset(&pcapIf->stats, '\0', sizeof(pcapIf->stats));
+  pcapIf->running = true;
+  nosSemaSignal(pcapIf->sema);
+  return ERR_OK;
+}
+
+/*
+ * Get statistics for interface.
+ */
+err_t pcapIfStats(struct netif *netif, struct pcapIfStats *stats)
+{
+  struct pcapIf *pcapIf = netif->state;
+
+  *stats = pcapIf->stats;
+  return pcapIf->running ? ERR_INPROGRESS : ERR_OK;
+}
@@ -0,0 +1,648 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory interface between two pico]OS unix port processes
+ * on Linux. Both processes map same POSIX shared memory object,
+ * which has a single-producer single-consumer ring for each direction.
+ *
+ * Each direction has a pool of frame buffers and two index rings:
+ * sender takes a free buffer from free ring, copies frame into it
+ * and passes buffer index to receiver in used ring. Receiver gives
+ * buffer back in free ring when it is done with it, so buffers can
+ * be released in any order.
+ *
+ * Other process is not trusted. By default receiver copies frame
+ * out of shared memory before stack sees it, so sender cannot change
+ * it while stack is parsing it. If zeroCopy is set in configuration,
+ * buffer is passed to stack as a custom pbuf and released when stack
+ * frees the pbuf. When stack holds too many buffers, frames are copied
+ * to keep sender going.
+ *
+ * Receiver that has emptied its ring sleeps on a futex in shared
+ * memory. Sender wakes it only if it is sleeping, so there is
+ * at most one doorbell for a batch of frames. Futex is waited by
+ * a host thread, which passes wakeup to receiver task using
+ * a signal, like tapif does.
+ */
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <picoos.h>
+#include <stdbool.h>
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/sys.h"
+#include "lwip/pbuf.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/ethip6.h"
+#include "netif/etharp.h"
+
+#include "netif/shmif.h"
+
+#ifdef __linux__
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Number of slots in each ring, must be power of two.
+ * Both processes must use same value.
+ */
+#ifndef SHMIF_SLOTS
+#define SHMIF_SLOTS 256
+#endif
+
+#if SHMIF_SLOTS & (SHMIF_SLOTS - 1)
+#error SHMIF_SLOTS must be power of two
+#endif
+
+/*
+ * Max frames received in one pass. After that task yields.
+ */
+#ifndef SHMIF_POLL_BUDGET
+#define SHMIF_POLL_BUDGET 64
+#endif
+
+/*
+ * Max buffers held by stack in zeroCopy mode. After that
+ * frames are copied.
+ */
+#ifndef SHMIF_RX_HOLD
+#define SHMIF_RX_HOLD (SHMIF_SLOTS / 2)
+#endif
+
+/*
+ * Signal used to wake up receiver task.
+ */
+#ifndef SHMIF_SIGNAL
+#define SHMIF_SIGNAL (SIGRTMIN + 1)
+#endif
+
+#define SHMIF_MAGIC      0x6c776971
+#define SHMIF_FRAME_SIZE LWIP_MEM_ALIGN_SIZE(ETH_PAD_SIZE + SIZEOF_ETH_HDR + 1500)
+#define CACHE_LINE       64
+
+/*
+ * Shared memory layout. Producer writes tail and freeHead,
+ * consumer freeTail, they are kept in separate cache lines.
+ */
+struct shmSlot
+{
+  u32_t len;
+  u8_t  data[SHMIF_FRAME_SIZE];
+
+};
+
+struct shmRing
+{
+  u32_t          tail __attribute__((aligned(CACHE_LINE)));
+  u32_t          freeHead;
+  u32_t          freeTail __attribute__((aligned(CACHE_LINE)));
+  u32_t          waiting;
+  u32_t          doorbell;
+  u32_t          used[SHMIF_SLOTS] __attribute__((aligned(CACHE_LINE)));
+  u32_t          free[SHMIF_SLOTS] __attribute__((aligned(CACHE_LINE)));
+  struct shmSlot slot[SHMIF_SLOTS] __attribute__((aligned(CACHE_LINE)));
+
+};
+
+struct shmArea
+{
+  u32_t          magic;
+  u32_t          slots;
+  struct shmRing ring[2];
+
+};
+
+/*
+ * Receive buffer for each slot of RX ring.
+ */
+struct shmIf;
+
+struct shmRxBuf
+{
+  struct pbuf_custom pc;
+  struct shmIf*      shmIf;
+  u32_t              index;
+  bool               held;
+
+};
+
+/*
+ * Interface-specific data.
+ */
+struct shmIf
+{
+  struct netif*     netif;
+  struct shmArea*   area;
+  struct shmRing*   rx;
+  struct shmRing*   tx;
+  u32_t             rxNext;
+  u32_t             rxFreeTail;
+  int               rxHeld;
+  bool              zeroCopy;
+  u32_t             armed;
+  int               pending;
+  NOSSEMA_t         sema;
+  NOSTASK_t         poll;
+  struct shmIf*     next;
+  struct shmIfStats stats;
+  struct shmRxBuf   rxBufs[SHMIF_SLOTS];
+
+};
+
+static void shmReadyContext(void);
+static void shmReady(int sig, siginfo_t *info, void *ucontext);
+
+/*
+ * All interfaces. Handler runs with all signals blocked,
+ * so context and stack are shared.
+ */
+static struct shmIf* shmList;
+static pthread_t     posThread;
+static ucontext_t    sigContext;
+
+#if PORTCFG_IRQ_STACK_SIZE >= PORTCFG_MIN_STACK_SIZE
+static char sigStack[PORTCFG_IRQ_STACK_SIZE];
+#else
+static char sigStack[PORTCFG_MIN_STACK_SIZE];
+#endif
+
+static void futexWait(u32_t *addr, u32_t val, bool shared)
+{
+  syscall(SYS_futex, addr, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futexWake(u32_t *addr, bool shared)
+{
+  syscall(SYS_futex, addr, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Host thread that sleeps on doorbell when receiver task
+ * has emptied the ring.
+ */
+static void* doorbellThread(void* arg)
+{
+  struct shmIf *shmIf = arg;
+  struct shmRing *rx = shmIf->rx;
+  u32_t          seq;
+
+  while (true) {
+
+    while (!__atomic_load_n(&shmIf->armed, __ATOMIC_ACQUIRE))
+      futexWait(&shmIf->armed, 0, false);
+
+    __atomic_store_n(&rx->waiting, 1, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&rx->doorbell, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rx->tail, __ATOMIC_SEQ_CST) == shmIf->rxNext)
+      futexWait(&rx->doorbell, seq, true);
+
+    __atomic_store_n(&rx->waiting, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE) == shmIf->rxNext)
+      continue;
+
+    __atomic_store_n(&shmIf->armed, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&shmIf->pending, 1, __ATOMIC_RELEASE);
+    pthread_kill(posThread, SHMIF_SIGNAL);
+  }
+
+  return NULL;
+}
+
+/*
+ * Handle "interrupt" from doorbell thread.
+ */
+static void shmReadyContext()
+{
+  struct shmIf* shmIf;
+
+  c_pos_intEnter();
+  for (shmIf = shmList; shmIf != NULL; shmIf = shmIf->next)
+    if (__atomic_exchange_n(&shmIf->pending, 0, __ATOMIC_ACQ_REL))
+      nosSemaSignal(shmIf->sema);
+
+  c_pos_intExit();
+  setcontext(&posCurrentTask_g->ucontext);
+  assert(0);
+}
+
+static void shmReady(int sig, siginfo_t *info, void *ucontext)
+{
+  getcontext(&sigContext);
+  sigContext.uc_stack.ss_sp = sigStack;
+  sigContext.uc_stack.ss_size = sizeof(sigStack);
+  sigContext.uc_stack.ss_flags = 0;
+  sigContext.uc_link = 0;
+  sigfillset(&sigContext.uc_sigmask);
+
+  makecontext(&sigContext, shmReadyContext, 0);
+  swapcontext(&posCurrentTask_g->ucontext, &sigContext);
+}
+
+/*
+ * Give buffer back to sender.
+ */
+static void rxRelease(struct shmIf *shmIf, u32_t index)
+{
+  struct shmRing *rx = shmIf->rx;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  rx->free[shmIf->rxFreeTail % SHMIF_SLOTS] = index;
+  ++shmIf->rxFreeTail;
+  __atomic_store_n(&rx->freeTail, shmIf->rxFreeTail, __ATOMIC_RELEASE);
+  SYS_ARCH_UNPROTECT(lev);
+}
+
+/*
+ * Release buffer when stack frees the pbuf.
+ */
+static void rxBufFree(struct pbuf *p)
+{
+  struct shmRxBuf *buf = (struct shmRxBuf*) p;
+  struct shmIf    *shmIf = buf->shmIf;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  buf->held = false;
+  --shmIf->rxHeld;
+  SYS_ARCH_UNPROTECT(lev);
+
+  rxRelease(shmIf, buf->index);
+}
+
+/*
+ * Send packet by copying it to a free buffer and passing
+ * it in TX ring. Receiver is woken up if it is sleeping.
+ */
+static err_t lowLevelOutput(struct netif *netif, struct pbuf *p)
+{
+  struct shmIf   *shmIf = netif->state;
+  struct shmRing *tx = shmIf->tx;
+  struct shmSlot *slot;
+  u32_t          freeHead;
+  u32_t          index;
+  u32_t          tail;
+
+  freeHead = tx->freeHead;
+  if (freeHead == __atomic_load_n(&tx->freeTail, __ATOMIC_ACQUIRE) ||
+      p->tot_len > SHMIF_FRAME_SIZE) {
+
+    ++shmIf->stats.txDrops;
+    LINK_STATS_INC(link.drop);
+    return ERR_IF;
+  }
+
+  // Bad index from receiver can only damage its own frames.
+  index = tx->free[freeHead % SHMIF_SLOTS] % SHMIF_SLOTS;
+  __atomic_store_n(&tx->freeHead, freeHead + 1, __ATOMIC_RELEASE);
+
+  slot = &tx->slot[index];
+  slot->len = pbuf_copy_partial(p, slot->data, p->tot_len, 0);
+
+  tail = tx->tail;
+  tx->used[tail % SHMIF_SLOTS] = index;
+  __atomic_store_n(&tx->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  // Only first frame after receiver went to sleep rings the bell.
+  if (__atomic_exchange_n(&tx->waiting, 0, __ATOMIC_SEQ_CST)) {
+
+    __atomic_add_fetch(&tx->doorbell, 1, __ATOMIC_SEQ_CST);
+    futexWake(&tx->doorbell, true);
+    ++shmIf->stats.doorbells;
+  }
+
+  ++shmIf->stats.txFrames;
+  LINK_STATS_INC(link.xmit);
+  return ERR_OK;
+}
+
+/*
+ * Pass at most budget frames from RX ring to stack.
+ * Returns number of frames.
+ */
+static int shmPoll(struct shmIf *shmIf, int budget)
+{
+  struct netif    *netif = shmIf->netif;
+  struct shmRing  *rx = shmIf->rx;
+  struct shmSlot  *slot;
+  struct shmRxBuf *buf;
+  struct pbuf     *p;
+  u32_t           tail;
+  u32_t           index;
+  u32_t           len;
+  int             n;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  tail = __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE);
+  if (tail - shmIf->rxNext > SHMIF_SLOTS) {
+
+    // Sender has trashed the ring, skip to its end.
+    ++shmIf->stats.rxErrors;
+    shmIf->rxNext = tail;
+  }
+
+  for (n = 0; n < budget && shmIf->rxNext != tail; n++) {
+
+    // Index and length are read only once, other process is not trusted.
+    index = __atomic_load_n(&rx->used[shmIf->rxNext % SHMIF_SLOTS], __ATOMIC_RELAXED);
+    ++shmIf->rxNext;
+
+    if (index >= SHMIF_SLOTS || shmIf->rxBufs[index].held) {
+
+      ++shmIf->stats.rxErrors;
+      LINK_STATS_INC(link.drop);
+      continue;
+    }
+
+    slot = &rx->slot[index];
+    buf  = &shmIf->rxBufs[index];
+    len  = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+
+    if (len > SHMIF_FRAME_SIZE || len < SIZEOF_ETH_HDR + ETH_PAD_SIZE) {
+
+      ++shmIf->stats.rxErrors;
+      LINK_STATS_INC(link.lenerr);
+      LINK_STATS_INC(link.drop);
+      rxRelease(shmIf, index);
+      continue;
+    }
+
+    if (shmIf->zeroCopy && shmIf->rxHeld < SHMIF_RX_HOLD) {
+
+      SYS_ARCH_PROTECT(lev);
+      buf->held = true;
+      ++shmIf->rxHeld;
+      SYS_ARCH_UNPROTECT(lev);
+
+      buf->pc.custom_free_function = rxBufFree;
+      p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &buf->pc, slot->data, SHMIF_FRAME_SIZE);
+    }
+    else {
+
+      p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+      if (p != NULL)
+        pbuf_take(p, slot->data, len);
+
+      rxRelease(shmIf, index);
+      if (p == NULL) {
+
+        ++shmIf->stats.drops;
+        LINK_STATS_INC(link.memerr);
+        LINK_STATS_INC(link.drop);
+        continue;
+      }
+    }
+
+    ++shmIf->stats.frames;
+    shmIf->stats.bytes += len;
+    LINK_STATS_INC(link.recv);
+
+    if (netif->input(p, netif) != ERR_OK) {
+
+      LWIP_DEBUGF(NETIF_DEBUG, ("shmIf: input error\n"));
+      LINK_STATS_INC(link.drop);
+      pbuf_free(p);
+    }
+  }
+
+  return n;
+}
+
+/*
+ * Receiver task. Ring is drained in passes limited by
+ * poll budget, then doorbell thread is armed again.
+ */
+static void shmThread(void* arg)
+{
+  struct shmIf *shmIf = (struct shmIf*) arg;
+
+  while (true) {
+
+    nosSemaWait(shmIf->sema, INFINITE);
+    ++shmIf->stats.wakeups;
+
+    while (shmPoll(shmIf, SHMIF_POLL_BUDGET) == SHMIF_POLL_BUDGET)
+      posTaskYield();
+
+    __atomic_store_n(&shmIf->armed, 1, __ATOMIC_RELEASE);
+    futexWake(&shmIf->armed, false);
+  }
+}
+
+/*
+ * Map shared memory. Both sides create it if it doesn't
+ * exist yet, new object is all zero which is a valid empty ring
+ * without free buffers. Receiver fills free ring when it starts.
+ */
+static struct shmArea *shmMap(const char *name)
+{
+  struct shmArea *area;
+  u32_t          unset;
+  int            fd;
+
+  fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+  if (fd == -1)
+    return NULL;
+
+  if (ftruncate(fd, sizeof(struct shmArea)) == -1) {
+
+    close(fd);
+    return NULL;
+  }
+
+  area = mmap(NULL, sizeof(struct shmArea), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (area == MAP_FAILED)
+    return NULL;
+
+  // Side that comes first initializes header.
+  unset = 0;
+  __atomic_compare_exchange_n(&area->magic, &unset, SHMIF_MAGIC, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  unset = 0;
+  __atomic_compare_exchange_n(&area->slots, &unset, SHMIF_SLOTS, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+  if (area->magic != SHMIF_MAGIC || area->slots != SHMIF_SLOTS) {
+
+    munmap(area, sizeof(struct shmArea));
+    return NULL;
+  }
+
+  return area;
+}
+
+/*
+ * Initialize interface.
+ */
+err_t shmIfInit(struct netif *netif)
+{
+  const struct shmIfConfig *config;
+  struct shmIf     *shmIf;
+  struct sigaction sig;
+  pthread_t        thread;
+  sigset_t         all;
+  sigset_t         old;
+  int              side;
+  int              st;
+  int              i;
+
+  LWIP_ASSERT("netif != NULL", (netif != NULL));
+
+  config = netif->state;
+  side = (config != NULL && config->side == 1) ? 1 : 0;
+
+  shmIf = mem_malloc(sizeof(struct shmIf));
+  if (shmIf == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("shmIfInit: out of memory\n"));
+    return ERR_MEM;
+  }
+
+  memset(shmIf, '\0', sizeof(struct shmIf));
+  shmIf->area = shmMap((config != NULL && config->name != NULL) ? config->name : "/picoos-lwip");
+  if (shmIf->area == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("shmIfInit: cannot map shared memory\n"));
+    mem_free(shmIf);
+    return ERR_IF;
+  }
+
+  shmIf->netif = netif;
+  shmIf->rx = &shmIf->area->ring[side];
+  shmIf->tx = &shmIf->area->ring[!side];
+  shmIf->zeroCopy = config != NULL && config->zeroCopy;
+
+  // Forget frames left from earlier run and give all buffers to sender.
+  shmIf->rxNext = __atomic_load_n(&shmIf->rx->tail, __ATOMIC_ACQUIRE);
+  shmIf->rxFreeTail = __atomic_load_n(&shmIf->rx->freeHead, __ATOMIC_ACQUIRE);
+  for (i = 0; i < SHMIF_SLOTS; i++) {
+
+    shmIf->rxBufs[i].shmIf = shmIf;
+    shmIf->rxBufs[i].index = i;
+    shmIf->rx->free[shmIf->rxFreeTail % SHMIF_SLOTS] = i;
+    ++shmIf->rxFreeTail;
+  }
+
+  __atomic_store_n(&shmIf->rx->freeTail, shmIf->rxFreeTail, __ATOMIC_RELEASE);
+
+#if LWIP_NETIF_HOSTNAME
+  netif->hostname = "lwip";
+#endif
+
+  NETIF_INIT_SNMP(netif, snmp_ifType_ethernet_csmacd, 10000000);
+
+  netif->state = shmIf;
+  netif->name[0] = 's';
+  netif->name[1] = 'h';
+  netif->output = etharp_output;
+
+#if LWIP_IPV6
+  netif->output_ip6 = ethip6_output;
+#endif
+
+  netif->linkoutput = lowLevelOutput;
+
+  // Locally administered ethernet address, different for each side
+  netif->hwaddr_len = ETHARP_HWADDR_LEN;
+  netif->hwaddr[0] = 0x2;
+  netif->hwaddr[1] = 0xbd;
+  netif->hwaddr[2] = 0x3;
+  netif->hwaddr[3] = 0x4;
+  netif->hwaddr[4] = 0x6;
+  netif->hwaddr[5] = 0x6 + side;
+
+  netif->mtu = 1500;
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+
+  shmIf->sema = nosSemaCreate(1, 0, "shm");
+  shmIf->next = shmList;
+  shmList = shmIf;
+
+  memset(&sig, '\0', sizeof(sig));
+
+  sig.sa_sigaction = shmReady;
+  sig.sa_flags     = SA_RESTART | SA_SIGINFO;
+  sigfillset(&sig.sa_mask);
+
+  sigaction(SHMIF_SIGNAL, &sig, NULL);
+
+  // Signal goes to thread that runs pico]OS, doorbell thread must not get any signals.
+  posThread = pthread_self();
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  st = pthread_create(&thread, NULL, doorbellThread, shmIf);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (st != 0) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("shmIfInit: cannot create thread\n"));
+    shmList = shmIf->next;
+    nosSemaDestroy(shmIf->sema);
+    munmap(shmIf->area, sizeof(struct shmArea));
+    netif->state = NULL;
+    mem_free(shmIf);
+    return ERR_IF;
+  }
+
+  pthread_detach(thread);
+
+  shmIf->poll = nosTaskCreate(shmThread, shmIf, 10, 300, "shmif");
+  return ERR_OK;
+}
+
+/*
+ * Get statistics for interface.
+ */
+err_t shmIfStats(struct netif *netif, struct shmIfStats *stats)
+{
+  struct shmIf *shmIf = netif->state;
+
+  *stats = shmIf->stats;
+  return ERR_OK;
+}
+
+#endif
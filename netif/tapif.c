@@ -26,238 +26,1381 @@
  * OF SUCH DAMAGE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for F_SETSIG
+#endif
+
 #include <picoos.h>
 #include <stdbool.h>
 
-#include "lwip/opt.h"
-#include "lwip/def.h"
-#include "lwip/mem.h"
-#include "lwip/pbuf.h"
-#include "lwip/stats.h"
-#include "lwip/snmp.h"
-#include "lwip/ethip6.h"
-#include "netif/etharp.h"
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/sys.h"
+#include "lwip/pbuf.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/ethip6.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ip.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/prot/tcp.h"
+#include "lwip/prot/udp.h"
+#include "netif/etharp.h"
+
+#include "netif/tapif.h"
+#include "netif/capture.h"
+
+#include <sys/time.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <memory.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#endif
+
+/*
+ * If TAPIF_EPOLL is set to 1, devices are watched by a host
+ * thread using epoll instead of SIGIO from each device.
+ */
+#ifndef TAPIF_EPOLL
+#define TAPIF_EPOLL 0
+#endif
+
+#if TAPIF_EPOLL
+
+#ifndef __linux__
+#error TAPIF_EPOLL is available only on Linux
+#endif
+
+#include <sys/epoll.h>
+#include <pthread.h>
+
+#elif defined(__linux__)
+
+/*
+ * Signal used for tap devices on Linux. It must be a queued
+ * realtime signal so that each device gets a signal with its
+ * own file descriptor. SIGIO is still used by kernel if
+ * signal queue overflows.
+ */
+#ifndef TAPIF_SIGNAL
+#define TAPIF_SIGNAL SIGRTMIN
+#endif
+
+#endif
+
+/*
+ * Default max number of frames received in one poll pass.
+ * After that task yields to let others run.
+ */
+#ifndef TAPIF_POLL_BUDGET
+#define TAPIF_POLL_BUDGET 64
+#endif
+
+/*
+ * Default busy-poll window in microseconds, 0 to disable.
+ * RX task keeps polling this long after traffic before sleeping.
+ */
+#ifndef TAPIF_BUSY_POLL
+#define TAPIF_BUSY_POLL 0
+#endif
+
+/*
+ * Priority of RX task while it yields between poll passes or
+ * busy-polls. posTaskYield() switches only to tasks of same
+ * priority, so task drops to this priority to let lower priority
+ * tasks (like tcpip thread) run. Frames are not received while
+ * tasks above this priority are running, and a task that never
+ * blocks stops receive completely. Task returns to its normal
+ * priority before it sleeps.
+ */
+#ifndef TAPIF_SPIN_PRIO
+#define TAPIF_SPIN_PRIO 1
+#endif
+
+/*
+ * Largest MTU that can be set with tapIfConfig.
+ */
+#ifndef TAPIF_MAX_MTU
+#define TAPIF_MAX_MTU 9000
+#endif
+
+/*
+ * Max number of pbufs sent with one writev. Longer
+ * chains are copied into a buffer, 0 copies all frames.
+ */
+#ifndef TAPIF_TX_IOV
+#define TAPIF_TX_IOV 16
+#endif
+
+#if defined(IOV_MAX) && TAPIF_TX_IOV + 1 > IOV_MAX
+#error TAPIF_TX_IOV must be less than IOV_MAX
+#endif
+
+/*
+ * Default number of frames queued when device cannot
+ * take them (EAGAIN), 0 to drop them immediately.
+ */
+#ifndef TAPIF_TX_RING
+#define TAPIF_TX_RING 32
+#endif
+
+/*
+ * Virtio-net headers (IFF_VNET_HDR) are available on Linux.
+ * Checksum offload with them needs per-interface checksum control.
+ */
+#ifdef __linux__
+#define TAPIF_VNET 1
+#define VNET_HDR_LEN sizeof(struct virtio_net_hdr)
+#else
+#define TAPIF_VNET 0
+#define VNET_HDR_LEN 0
+#endif
+
+/*
+ * Device queue. Without IFF_MULTI_QUEUE there is only one.
+ * Each queue has its own RX task.
+ */
+struct tapRxBuf;
+
+struct tapQueue
+{
+  struct netif*          netif;
+  int                    tap;
+  NOSTASK_t              poll;
+  NOSSEMA_t              sema;
+  struct pbuf*           rxSpare;
+  char*                  rxJumbo;
+  struct tapRxBuf*       rxBufs;
+  struct tapRxBuf*       rxFree;
+  bool                   rxStarved;
+  struct tapQueue*       next;
+  struct tapIfQueueStats stats;
+
+};
+
+/*
+ * Frame waiting in TX ring for device to become writable.
+ */
+struct tapTxSlot
+{
+  struct pbuf*          p;
+#if TAPIF_VNET
+  struct virtio_net_hdr vnet;
+#endif
+
+};
+
+/*
+ * Interface-specific data.
+ */
+struct tapIf
+{
+  char                 name[IFNAMSIZ];
+  int                  tap;
+  char*                txCopy;
+  struct tapTxSlot*    txRing;
+  int                  txSize;
+  int                  txHead;
+  int                  txCount;
+#if TAPIF_EPOLL
+  int                  txFd;
+#endif
+  struct tapIfTxStats  txStats;
+  bool                 vnetHdr;
+  bool                 offload;
+  int                  pollBudget;
+  u32_t                busyPoll;
+  int                  queueCount;
+  struct tapQueue      queue[1];
+
+};
+
+/*
+ * Receive buffer of a queue that has a pbuf budget.
+ * Frame data follows the header.
+ */
+struct tapRxBuf
+{
+  struct pbuf_custom pc;
+  struct tapQueue*   queue;
+  struct tapRxBuf*   next;
+
+};
+
+static bool tapIfInput(struct tapQueue *queue);
+
+static void ioReadyContext(void);
+static void ioReady(int sig, siginfo_t *info, void *ucontext);
+
+/*
+ * All queues of all interfaces. Only one "interrupt" can be active at a time
+ * (all signals are blocked while it runs), so context and stack
+ * for it are shared by all interfaces.
+ */
+static struct tapQueue* tapList;
+static int              tapCount;
+static ucontext_t       sigContext;
+#if !TAPIF_EPOLL
+static int              sigFd;
+#endif
+
+#if PORTCFG_IRQ_STACK_SIZE >= PORTCFG_MIN_STACK_SIZE
+static char sigStack[PORTCFG_IRQ_STACK_SIZE];
+#else
+static char sigStack[PORTCFG_MIN_STACK_SIZE];
+#endif
+
+#if TAPIF_EPOLL
+
+/*
+ * Event-driven wakeup. Host thread waits for all tap devices
+ * with epoll and passes ready queues to "interrupt" handler
+ * in a single-producer ring. One SIGIO is raised for a batch of
+ * events. Devices are in EPOLLONESHOT mode, so each of them is
+ * in ring at most once and is re-armed when tapThread has drained it.
+ * If ring still fills up, host thread waits until handler has
+ * emptied it.
+ */
+#define READY_RING_SIZE 64
+
+static int              epollFd = -1;
+static pthread_t        posThread;
+static struct tapQueue* readyRing[READY_RING_SIZE];
+static unsigned int     readyHead;
+static unsigned int     readyTail;
+static int              irqPending;
+
+/*
+ * Publish ready queues and raise "interrupt" unless one is pending.
+ */
+static void ioRaise(unsigned int tail)
+{
+  __atomic_store_n(&readyTail, tail, __ATOMIC_RELEASE);
+  if (!__atomic_exchange_n(&irqPending, 1, __ATOMIC_ACQ_REL))
+    pthread_kill(posThread, SIGIO);
+}
+
+static void* ioThread(void* arg)
+{
+  struct epoll_event events[16];
+  unsigned int       tail;
+  int                n;
+  int                i;
+
+  while (true) {
+
+    n = epoll_wait(epollFd, events, 16, -1);
+    if (n <= 0)
+      continue;
+
+    tail = readyTail;
+    for (i = 0; i < n; i++) {
+
+      // Ring is full, let handler drain it before adding more.
+      while (tail - __atomic_load_n(&readyHead, __ATOMIC_ACQUIRE) >= READY_RING_SIZE) {
+
+        ioRaise(tail);
+        usleep(100);
+      }
+
+      readyRing[tail++ % READY_RING_SIZE] = events[i].data.ptr;
+    }
+
+    ioRaise(tail);
+  }
+
+  return NULL;
+}
+
+static int ioStart(void)
+{
+  pthread_t thread;
+  sigset_t  all;
+  sigset_t  old;
+  int       st;
+
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd == -1)
+    return -1;
+
+  // SIGIO goes to thread that runs pico]OS, I/O thread must not get any signals.
+  posThread = pthread_self();
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  st = pthread_create(&thread, NULL, ioThread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (st != 0) {
+
+    close(epollFd);
+    epollFd = -1;
+    return -1;
+  }
+
+  pthread_detach(thread);
+  return 0;
+}
+
+
+static int ioWatch(struct tapQueue *queue, int op)
+{
+  struct epoll_event ev;
+
+  memset(&ev, '\0', sizeof(ev));
+  ev.events   = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = queue;
+  return epoll_ctl(epollFd, op, queue->tap, &ev);
+}
+
+/*
+ * Watch for space in device when TX ring has frames. Duplicate
+ * descriptor is used so that it can be armed separately from
+ * receive. Wakeup goes to first queue, which flushes the ring.
+ */
+static void txWatch(struct tapIf *tapIf)
+{
+  struct epoll_event ev;
+
+  memset(&ev, '\0', sizeof(ev));
+  ev.events   = EPOLLOUT | EPOLLONESHOT;
+  ev.data.ptr = &tapIf->queue[0];
+  if (epoll_ctl(epollFd, EPOLL_CTL_MOD, tapIf->txFd, &ev) == -1 && errno == ENOENT)
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, tapIf->txFd, &ev);
+}
+
+#endif
+
+/*
+ * Handle "interrupt" from tap device when packet comes in.
+ */
+static void ioReadyContext()
+{
+  c_pos_intEnter();
+#if TAPIF_EPOLL
+  unsigned int head;
+  unsigned int tail;
+
+  __atomic_store_n(&irqPending, 0, __ATOMIC_SEQ_CST);
+  tail = __atomic_load_n(&readyTail, __ATOMIC_ACQUIRE);
+  for (head = readyHead; head != tail; head++)
+    nosSemaSignal(readyRing[head % READY_RING_SIZE]->sema);
+
+  __atomic_store_n(&readyHead, head, __ATOMIC_RELEASE);
+#else
+  struct tapQueue* queue;
+
+  // Wake up only queue that signaled, or all of them if it is not known.
+  for (queue = tapList; queue != NULL; queue = queue->next)
+    if (sigFd == -1 || sigFd == queue->tap)
+      nosSemaSignal(queue->sema);
+#endif
+  c_pos_intExit();
+  setcontext(&posCurrentTask_g->ucontext);
+  assert(0);
+}
+
+static void ioReady(int sig, siginfo_t *info, void *ucontext)
+{
+#if !TAPIF_EPOLL
+#ifdef __linux__
+  if (sig == TAPIF_SIGNAL && info->si_code > 0)
+    sigFd = info->si_fd;
+  else
+    sigFd = -1;
+#else
+  sigFd = -1;
+#endif
+#endif
+
+  getcontext(&sigContext);
+  sigContext.uc_stack.ss_sp = sigStack;
+  sigContext.uc_stack.ss_size = sizeof(sigStack);
+  sigContext.uc_stack.ss_flags = 0;
+  sigContext.uc_link = 0;
+  sigfillset(&sigContext.uc_sigmask);
+
+  makecontext(&sigContext, ioReadyContext, 0);
+  swapcontext(&posCurrentTask_g->ucontext, &sigContext);
+}
+
+#ifdef __linux__
+
+/*
+ * Open Linux tap device.
+ */
+static int tapOpen(struct tapIf *tapIf)
+{
+  struct ifreq ifr;
+  int          fd;
+
+  fd = open("/dev/net/tun", O_RDWR);
+  if (fd == -1)
+    return -1;
+
+  memset(&ifr, '\0', sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (tapIf->queueCount > 1)
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+
+  if (tapIf->vnetHdr)
+    ifr.ifr_flags |= IFF_VNET_HDR;
+
+  strncpy(ifr.ifr_name, tapIf->name, IFNAMSIZ - 1);
+
+  if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+
+    close(fd);
+    return -1;
+  }
+
+  // Kernel might have chosen the name (if it was a pattern like "tap%d").
+  strncpy(tapIf->name, ifr.ifr_name, IFNAMSIZ - 1);
+  return fd;
+}
+
+static int tapSetAddr(int sock, struct ifreq *ifr, unsigned long req, const ip4_addr_t *addr)
+{
+  struct sockaddr_in *sin = (struct sockaddr_in*) &ifr->ifr_addr;
+
+  memset(sin, '\0', sizeof(*sin));
+  sin->sin_family      = AF_INET;
+  sin->sin_addr.s_addr = ip4_addr_get_u32(addr);
+  return ioctl(sock, req, ifr);
+}
+
+/*
+ * Give gateway address to host side of tap and bring it up.
+ * MTU is set after that, so that link is up even if host
+ * doesn't accept the MTU. IPv6 link-local address is assigned
+ * by kernel automatically.
+ */
+static err_t tapConfigure(struct netif *netif)
+{
+  struct tapIf *tapIf = netif->state;
+  struct ifreq ifr;
+  int          sock;
+  int          st;
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == -1)
+    return ERR_IF;
+
+  memset(&ifr, '\0', sizeof(ifr));
+  strncpy(ifr.ifr_name, tapIf->name, IFNAMSIZ - 1);
+
+  st = tapSetAddr(sock, &ifr, SIOCSIFADDR, netif_ip4_gw(netif));
+  if (st != -1)
+    st = tapSetAddr(sock, &ifr, SIOCSIFNETMASK, netif_ip4_netmask(netif));
+
+  if (st != -1)
+    st = ioctl(sock, SIOCGIFFLAGS, &ifr);
+
+  if (st != -1) {
+
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    st = ioctl(sock, SIOCSIFFLAGS, &ifr);
+  }
+
+  if (st != -1) {
+
+    ifr.ifr_mtu = netif->mtu;
+    if (ioctl(sock, SIOCSIFMTU, &ifr) == -1)
+      LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: cannot set mtu %d for %s\n", netif->mtu, tapIf->name));
+  }
+
+  close(sock);
+  return (st == -1) ? ERR_IF : ERR_OK;
+}
+
+#else
+
+/*
+ * Open FreeBSD tap device.
+ */
+static int tapOpen(struct tapIf *tapIf)
+{
+  char dev[IFNAMSIZ + 5];
+
+  sprintf(dev, "/dev/%s", tapIf->name);
+  return open(dev, O_RDWR);
+}
+
+static err_t tapConfigure(struct netif *netif)
+{
+  struct tapIf *tapIf = netif->state;
+  char         ifconfig[100];
+
+  sprintf (ifconfig,
+           "ifconfig %s %d.%d.%d.%d ",
+           tapIf->name,
+           ip4_addr1(netif_ip4_gw(netif)),
+           ip4_addr2(netif_ip4_gw(netif)),
+           ip4_addr3(netif_ip4_gw(netif)),
+           ip4_addr4(netif_ip4_gw(netif)));
+
+  sprintf (ifconfig + strlen(ifconfig),
+           "netmask %d.%d.%d.%d up",
+           ip4_addr1(netif_ip4_netmask(netif)),
+           ip4_addr2(netif_ip4_netmask(netif)),
+           ip4_addr3(netif_ip4_netmask(netif)),
+           ip4_addr4(netif_ip4_netmask(netif)));
+
+  system(ifconfig);
+
+  // Separately, so that link is up even if MTU is not accepted.
+  sprintf (ifconfig, "ifconfig %s mtu %d", tapIf->name, netif->mtu);
+  if (system(ifconfig) != 0)
+    LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: cannot set mtu %d for %s\n", netif->mtu, tapIf->name));
+
+#if LWIP_IPV6
+  sprintf (ifconfig, "ifconfig %s inet6 -ifdisabled", tapIf->name);
+  system(ifconfig);
+#endif
+
+  return ERR_OK;
+}
+
+#endif
+
+#if TAPIF_VNET
+
+/*
+ * Find TCP or UDP header in frame and calculate checksum over
+ * pseudo header and sumLen bytes of the segment. Returns
+ * protocol, or zero if frame has nothing to checksum
+ * (like IPv4 fragments or IPv6 with extension headers).
+ */
+static u8_t l4Checksum(struct pbuf *p, u16_t base, bool full, u16_t *offset, u16_t *sum)
+{
+  u8_t           *frame = (u8_t*) p->payload + base;
+  struct eth_hdr *ethhdr = (struct eth_hdr*) frame;
+  struct pbuf    l4;
+  u8_t           proto;
+  u16_t          len;
+#if LWIP_IPV4
+  struct ip_hdr  *iphdr;
+  ip4_addr_t     src4, dest4;
+#endif
+#if LWIP_IPV6
+  struct ip6_hdr *ip6hdr;
+  ip6_addr_t     src6, dest6;
+#endif
+
+  if (p->len < base + SIZEOF_ETH_HDR)
+    return 0;
+
+  switch (lwip_htons(ethhdr->type))
+  {
+#if LWIP_IPV4
+  case ETHTYPE_IP:
+    iphdr = (struct ip_hdr*) (frame + SIZEOF_ETH_HDR);
+    if (p->len < base + SIZEOF_ETH_HDR + IP_HLEN ||
+        (IPH_OFFSET(iphdr) & PP_HTONS(IP_OFFMASK | IP_MF)) != 0)
+      return 0;
+
+    proto   = IPH_PROTO(iphdr);
+    *offset = SIZEOF_ETH_HDR + IPH_HL_BYTES(iphdr);
+    len     = lwip_ntohs(IPH_LEN(iphdr)) - IPH_HL_BYTES(iphdr);
+    ip4_addr_copy(src4, iphdr->src);
+    ip4_addr_copy(dest4, iphdr->dest);
+    break;
+#endif
+
+#if LWIP_IPV6
+  case ETHTYPE_IPV6:
+    ip6hdr = (struct ip6_hdr*) (frame + SIZEOF_ETH_HDR);
+    if (p->len < base + SIZEOF_ETH_HDR + IP6_HLEN)
+      return 0;
+
+    proto   = IP6H_NEXTH(ip6hdr);
+    *offset = SIZEOF_ETH_HDR + IP6_HLEN;
+    len     = IP6H_PLEN(ip6hdr);
+    ip6_addr_copy_from_packed(src6, ip6hdr->src);
+    ip6_addr_copy_from_packed(dest6, ip6hdr->dest);
+    break;
+#endif
+
+  default:
+    return 0;
+  }
+
+  if (proto != IP_PROTO_TCP && proto != IP_PROTO_UDP)
+    return 0;
+
+  // Header must be in first pbuf and segment must be complete.
+  if (p->len < base + *offset + (proto == IP_PROTO_TCP ? TCP_HLEN : UDP_HLEN) ||
+      p->tot_len < base + *offset + len)
+    return 0;
+
+  // Checksum is calculated from payload start, so use a pbuf that starts from segment.
+  l4 = *p;
+  l4.payload  = frame + *offset;
+  l4.len     -= base + *offset;
+  l4.tot_len -= base + *offset;
+
+#if LWIP_IPV4
+  if (lwip_htons(ethhdr->type) == ETHTYPE_IP)
+    *sum = inet_chksum_pseudo_partial(&l4, proto, len, full ? len : 0, &src4, &dest4);
+#endif
+#if LWIP_IPV6
+  if (lwip_htons(ethhdr->type) == ETHTYPE_IPV6)
+    *sum = ip6_chksum_pseudo_partial(&l4, proto, len, full ? len : 0, &src6, &dest6);
+#endif
+
+  return proto;
+}
+
+/*
+ * Fill virtio-net header for frame to be sent. Host
+ * completes TCP checksum, stack has calculated others.
+ */
+static void vnetOutput(struct tapIf *tapIf, struct pbuf *p, struct virtio_net_hdr *hdr)
+{
+  struct tcp_hdr *tcphdr;
+  u16_t          offset;
+  u16_t          sum;
+
+  memset(hdr, '\0', sizeof(*hdr));
+  if (!tapIf->offload || l4Checksum(p, 0, false, &offset, &sum) != IP_PROTO_TCP)
+    return;
+
+  // Host expects checksum field to contain sum of pseudo header.
+  tcphdr = (struct tcp_hdr*) ((u8_t*) p->payload + offset);
+  tcphdr->chksum = ~sum;
+
+  hdr->flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  hdr->csum_start  = offset;
+  hdr->csum_offset = offsetof(struct tcp_hdr, chksum);
+}
+
+/*
+ * Check virtio-net header of received frame. Stack doesn't check
+ * TCP or UDP checksums on this interface, so they are checked here
+ * unless host has already done it or frame is from host itself
+ * (in which case checksum is not even complete).
+ */
+static bool vnetInput(struct tapIf *tapIf, struct pbuf *p, const struct virtio_net_hdr *hdr)
+{
+  struct udp_hdr *udphdr;
+  u16_t          offset;
+  u16_t          sum;
+  u8_t           proto;
+
+  if (!tapIf->offload || (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)))
+    return true;
+
+  proto = l4Checksum(p, ETH_PAD_SIZE, true, &offset, &sum);
+  if (proto == 0)
+    return true;
+
+  // Zero UDP checksum means that there is no checksum (allowed only for IPv4).
+  udphdr = (struct udp_hdr*) ((u8_t*) p->payload + ETH_PAD_SIZE + offset);
+  if (proto == IP_PROTO_UDP && udphdr->chksum == 0 &&
+      lwip_htons(((struct eth_hdr*) ((u8_t*) p->payload + ETH_PAD_SIZE))->type) == ETHTYPE_IP)
+    return true;
+
+  return sum == 0;
+}
+
+#ifdef __linux__
+/*
+ * Find out if device from launcher uses virtio-net headers.
+ */
+static bool tapVnetHdr(int fd)
+{
+  struct ifreq ifr;
+
+  memset(&ifr, '\0', sizeof(ifr));
+  return ioctl(fd, TUNGETIFF, &ifr) != -1 && (ifr.ifr_flags & IFF_VNET_HDR);
+}
+#endif
+
+#endif
+
+/*
+ * Allocate receive buffers for queue that has a pbuf budget.
+ */
+static err_t rxBudgetInit(struct tapQueue *queue, int budget, u16_t size)
+{
+  struct tapRxBuf *buf;
+  int             bufSize;
+  int             i;
+
+  if (budget <= 0)
+    return ERR_OK;
+
+  bufSize = LWIP_MEM_ALIGN_SIZE(sizeof(struct tapRxBuf) + size);
+  queue->rxBufs = nosMemAlloc(budget * bufSize);
+  if (queue->rxBufs == NULL)
+    return ERR_MEM;
+
+  for (i = 0; i < budget; i++) {
+
+    buf = (struct tapRxBuf*) ((char*) queue->rxBufs + i * bufSize);
+    buf->queue = queue;
+    buf->next  = queue->rxFree;
+    queue->rxFree = buf;
+  }
+
+  return ERR_OK;
+}
+
+/*
+ * Return receive buffer to queue when stack frees the pbuf.
+ * Queue that ran out of buffers is woken up.
+ */
+static void rxBufFree(struct pbuf *p)
+{
+  struct tapRxBuf *buf = (struct tapRxBuf*) p;
+  struct tapQueue *queue = buf->queue;
+  bool            wake;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  buf->next = queue->rxFree;
+  queue->rxFree = buf;
+  wake = queue->rxStarved;
+  queue->rxStarved = false;
+  SYS_ARCH_UNPROTECT(lev);
+
+  if (wake)
+    nosSemaSignal(queue->sema);
+}
+
+/*
+ * Allocate pbuf for received frame, either from queue budget
+ * or from pbuf pool.
+ */
+static struct pbuf *rxAlloc(struct tapQueue *queue, u16_t size)
+{
+  struct tapRxBuf *buf;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  if (queue->rxBufs == NULL)
+    return pbuf_alloc(PBUF_RAW, size, PBUF_POOL);
+
+  SYS_ARCH_PROTECT(lev);
+  buf = queue->rxFree;
+  if (buf != NULL)
+    queue->rxFree = buf->next;
+  else if (!queue->rxStarved) {
+
+    queue->rxStarved = true;
+    ++queue->stats.starved;
+  }
+
+  SYS_ARCH_UNPROTECT(lev);
+
+  if (buf == NULL)
+    return NULL;
+
+  buf->pc.custom_free_function = rxBufFree;
+  return pbuf_alloced_custom(PBUF_RAW, size, PBUF_REF, &buf->pc, buf + 1, size);
+}
+
+/*
+ * Initialize chip.
+ */
+static err_t lowLevelInit(struct netif *netif, const struct tapIfConfig *config)
+{
+  struct tapIf    *tapIf = netif->state;
+  struct tapQueue *queue;
+  int             i;
+
+  // Set ethernet address
+  netif->hwaddr_len = ETHARP_HWADDR_LEN;
+  netif->hwaddr[0] = 0x0;
+  netif->hwaddr[1] = 0xbd;
+  netif->hwaddr[2] = 0x3;
+  netif->hwaddr[3] = 0x4;
+  netif->hwaddr[4] = 0x5;
+  netif->hwaddr[5] = 0x6 + tapCount;
+
+  netif->mtu = 1500;
+  if (config != NULL && config->mtu > 0)
+    netif->mtu = LWIP_MIN(config->mtu, TAPIF_MAX_MTU);
+
+  tapIf->pollBudget = TAPIF_POLL_BUDGET;
+  tapIf->busyPoll   = TAPIF_BUSY_POLL;
+  if (config != NULL && config->pollBudget > 0)
+    tapIf->pollBudget = config->pollBudget;
+
+  if (config != NULL && config->busyPoll != 0)
+    tapIf->busyPoll = (config->busyPoll > 0) ? config->busyPoll : 0;
+
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+
+  struct sigaction  sig;
+  int               flags;
+  int               txSize;
+
+  // Frames with too many pbufs for writev are copied here.
+  tapIf->txCopy = nosMemAlloc(VNET_HDR_LEN + SIZEOF_ETH_HDR + netif->mtu);
+  if (tapIf->txCopy == NULL) {
+
+    LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: out of memory\n"));
+    return ERR_MEM;
+  }
+
+  txSize = TAPIF_TX_RING;
+  if (config != NULL && config->txRing != 0)
+    txSize = (config->txRing > 0) ? config->txRing : 0;
+
+  if (txSize > 0) {
+
+    tapIf->txRing = nosMemAlloc(txSize * sizeof(struct tapTxSlot));
+    if (tapIf->txRing == NULL) {
+
+      LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: out of memory\n"));
+      return ERR_MEM;
+    }
+
+    tapIf->txSize = txSize;
+  }
+
+  for (i = 0; i < tapIf->queueCount; i++)
+    if (rxBudgetInit(&tapIf->queue[i],
+                     (config != NULL) ? config->budget : 0,
+                     netif->mtu + SIZEOF_ETH_HDR + ETH_PAD_SIZE) != ERR_OK) {
+
+      LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: out of memory\n"));
+      return ERR_MEM;
+    }
+
+  // Queues without budget read long frames partly here.
+  for (i = 0; i < tapIf->queueCount; i++) {
+
+    queue = &tapIf->queue[i];
+    if (queue->rxBufs == NULL && netif->mtu + SIZEOF_ETH_HDR + ETH_PAD_SIZE > PBUF_POOL_BUFSIZE) {
+
+      queue->rxJumbo = nosMemAlloc(netif->mtu + SIZEOF_ETH_HDR);
+      if (queue->rxJumbo == NULL) {
+
+        LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: out of memory\n"));
+        return ERR_MEM;
+      }
+    }
+  }
+
+  memset(tapIf->name, '\0', sizeof(tapIf->name));
+  strncpy(tapIf->name,
+          (config != NULL && config->name != NULL) ? config->name : "tap0",
+          IFNAMSIZ - 1);
+
+  if (config != NULL && config->offload) {
+
+#if TAPIF_VNET && LWIP_CHECKSUM_CTRL_PER_NETIF
+    tapIf->vnetHdr = true;
+    tapIf->offload = true;
+#else
+    LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: offloads not available\n"));
+#endif
+  }
+
+  if (config != NULL && config->fd > 0) {
+
+    // Opened and configured by somebody else.
+    tapIf->queue[0].tap = config->fd;
+#if TAPIF_VNET
+    tapIf->vnetHdr = tapVnetHdr(config->fd);
+    tapIf->offload = tapIf->offload && tapIf->vnetHdr;
+#endif
+  }
+  else {
+
+    // Each open attaches one more queue to multi-queue device.
+    for (i = 0; i < tapIf->queueCount; i++) {
+
+      tapIf->queue[i].tap = tapOpen(tapIf);
+      if (tapIf->queue[i].tap == -1) {
+
+        LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: cannot open %s\n", tapIf->name));
+        while (--i >= 0)
+          close(tapIf->queue[i].tap);
 
-#include "netif/tapif.h"
+        return ERR_IF;
+      }
+    }
 
-#include <sys/time.h>
-#include <assert.h>
-#include <stdio.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/select.h>
-#include <memory.h>
-#include <signal.h>
-#include <errno.h>
+    if (tapConfigure(netif) != ERR_OK)
+      LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: cannot configure %s\n", tapIf->name));
+  }
 
-/*
- * Interface-specific data.
- */
-struct tapIf
-{
-  int       tap;
-  NOSTASK_t poll;
-  NOSSEMA_t sema;
+  // Frames are always sent using first queue.
+  tapIf->tap = tapIf->queue[0].tap;
 
-};
+#if TAPIF_VNET
+  // Host may now pass frames with partial checksum.
+  if (tapIf->offload && ioctl(tapIf->tap, TUNSETOFFLOAD, TUN_F_CSUM) == -1) {
 
-static bool tapIfInput(struct netif *netif);
+    LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: cannot enable offloads for %s\n", tapIf->name));
+    tapIf->offload = false;
+  }
 
-static void ioReadyContext(void);
-static void ioReady(int sig, siginfo_t *info, void *ucontext);
+  if (tapIf->offload)
+    NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL &
+                                   ~(NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP));
+#endif
 
-static ucontext_t sigContext;
-static NOSSEMA_t  pollSema;
+  memset(&sig, '\0', sizeof(sig));
 
-#if PORTCFG_IRQ_STACK_SIZE >= PORTCFG_MIN_STACK_SIZE
-static char sigStack[PORTCFG_IRQ_STACK_SIZE];
-#else
-static char sigStack[PORTCFG_MIN_STACK_SIZE];
+  sig.sa_sigaction = ioReady;
+  sig.sa_flags     = SA_RESTART | SA_SIGINFO;
+
+  // Handler must not be interrupted by other "interrupts", they share the context.
+  sigfillset(&sig.sa_mask);
+
+  sigaction(SIGIO, &sig, NULL);
+#if !TAPIF_EPOLL && defined(__linux__)
+  sigaction(TAPIF_SIGNAL, &sig, NULL);
+#endif
+
+#if TAPIF_EPOLL
+  for (i = 0; i < tapIf->queueCount; i++) {
+
+    queue = &tapIf->queue[i];
+    flags = fcntl(queue->tap, F_GETFL, 0);
+    fcntl(queue->tap, F_SETFL, flags | O_NONBLOCK);
+
+    if ((epollFd == -1 && ioStart() == -1) || ioWatch(queue, EPOLL_CTL_ADD) == -1) {
+
+      LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: cannot watch %s\n", tapIf->name));
+      while (--i >= 0)
+        ioWatch(&tapIf->queue[i], EPOLL_CTL_DEL);
+
+      return ERR_IF;
+    }
+  }
+
+  if (tapIf->txRing != NULL) {
+
+    tapIf->txFd = dup(tapIf->tap);
+    if (tapIf->txFd == -1) {
+
+      LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: no TX ring for %s\n", tapIf->name));
+      nosMemFree(tapIf->txRing);
+      tapIf->txRing = NULL;
+      tapIf->txSize = 0;
+    }
+  }
+#endif
+
+  for (i = 0; i < tapIf->queueCount; i++) {
+
+    queue = &tapIf->queue[i];
+
+    // Queue must be in list before it can signal.
+    queue->next = tapList;
+    tapList = queue;
+
+#if !TAPIF_EPOLL
+    fcntl(queue->tap, F_SETOWN, getpid());
+#ifdef __linux__
+    fcntl(queue->tap, F_SETSIG, TAPIF_SIGNAL);
 #endif
+    flags = fcntl(queue->tap, F_GETFL, 0);
+    fcntl(queue->tap, F_SETFL, flags | O_ASYNC | O_NONBLOCK);
+#endif
+  }
+
+  ++tapCount;
+  return ERR_OK;
+}
 
 /*
- * Handle "interrupt" from tap device when packet comes in.
+ * Send packet that has too many pbufs for writev.
  */
-static void ioReadyContext()
+static ssize_t writeCopy(struct netif *netif, const void *hdr, size_t hdrLen, struct pbuf *p)
 {
-  c_pos_intEnter();
-  nosSemaSignal(pollSema);
-  c_pos_intExit();
-  setcontext(&posCurrentTask_g->ucontext);
-  assert(0);
+  struct tapIf *tapIf = netif->state;
+
+  if (p->tot_len > SIZEOF_ETH_HDR + netif->mtu) {
+
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  if (hdrLen > 0)
+    memcpy(tapIf->txCopy, hdr, hdrLen);
+
+  pbuf_copy_partial(p, tapIf->txCopy + hdrLen, p->tot_len, 0);
+  return write(tapIf->tap, tapIf->txCopy, hdrLen + p->tot_len);
 }
 
-static void ioReady(int sig, siginfo_t *info, void *ucontext)
+/*
+ * Write frame to device. Pbuf chain is sent directly with writev,
+ * after virtio-net header if there is one.
+ */
+static ssize_t txWrite(struct netif *netif, const void *hdr, struct pbuf *p)
 {
-  getcontext(&sigContext);
-  sigContext.uc_stack.ss_sp = sigStack;
-  sigContext.uc_stack.ss_size = sizeof(sigStack);
-  sigContext.uc_stack.ss_flags = 0;
-  sigContext.uc_link = 0;
-  sigfillset(&sigContext.uc_sigmask);
+  struct tapIf *tapIf = netif->state;
+  struct pbuf  *q;
+  struct iovec iov[TAPIF_TX_IOV + 1];
+  int          iovCount;
+  int          first;
 
-  makecontext(&sigContext, ioReadyContext, 0);
-  swapcontext(&posCurrentTask_g->ucontext, &sigContext);
+  iovCount = 0;
+  if (hdr != NULL) {
+
+    iov[0].iov_base = (void*) hdr;
+    iov[0].iov_len  = VNET_HDR_LEN;
+    ++iovCount;
+  }
+
+  first = iovCount;
+  for(q = p; q != NULL && iovCount - first < TAPIF_TX_IOV; q = q->next) {
+
+    iov[iovCount].iov_base = q->payload;
+    iov[iovCount].iov_len  = q->len;
+    ++iovCount;
+  }
+
+  if (q == NULL)
+    return writev(tapIf->tap, iov, iovCount);
+
+  return writeCopy(netif, hdr, first ? VNET_HDR_LEN : 0, p);
 }
 
 /*
- * Initialize chip.
+ * Queue frame that device could not take now. It is
+ * sent by first RX task when device becomes writable.
+ * Stack may reuse PBUF_REF/ROM payloads after linkoutput
+ * returns and txFlush adjusts padding word, so frame
+ * is copied in those cases.
  */
-static void lowLevelInit(struct netif *netif)
+static err_t txQueue(struct tapIf *tapIf, struct pbuf *p, const void *hdr)
 {
-  struct tapIf *tapIf = netif->state;
+  struct tapTxSlot *slot;
+  bool             wake;
+  SYS_ARCH_DECL_PROTECT(lev);
 
-  // Set ethernet address
-  netif->hwaddr_len = ETHARP_HWADDR_LEN;
-  netif->hwaddr[0] = 0x0;
-  netif->hwaddr[1] = 0xbd;
-  netif->hwaddr[2] = 0x3;
-  netif->hwaddr[3] = 0x4;
-  netif->hwaddr[4] = 0x5;
-  netif->hwaddr[5] = 0x6;
+  if (ETH_PAD_SIZE > 0 || PBUF_NEEDS_COPY(p)) {
 
-  netif->mtu = 1500;
-  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+    p = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+    if (p == NULL) {
 
-  struct sigaction  sig;
-  int               flags;
-  char              ifconfig[80];
+      SYS_ARCH_PROTECT(lev);
+      ++tapIf->txStats.drops;
+      SYS_ARCH_UNPROTECT(lev);
 
-  tapIf->tap = open("/dev/tap0", O_RDWR);
-  P_ASSERT("tap0", tapIf->tap != -1);
+      LINK_STATS_INC(link.memerr);
+      LINK_STATS_INC(link.drop);
+      return ERR_MEM;
+    }
+  }
+  else
+    pbuf_ref(p);
 
-  sprintf (ifconfig,
-           "ifconfig tap0 %d.%d.%d.%d ",
-           ip4_addr1(&(netif->gw)),
-           ip4_addr2(&(netif->gw)),
-           ip4_addr3(&(netif->gw)),
-           ip4_addr4(&(netif->gw)));
+  SYS_ARCH_PROTECT(lev);
+  if (tapIf->txCount == tapIf->txSize) {
 
-  sprintf (ifconfig + strlen(ifconfig),
-           "netmask %d.%d.%d.%d up",
-           ip4_addr1(&(netif->netmask)),
-           ip4_addr2(&(netif->netmask)),
-           ip4_addr3(&(netif->netmask)),
-           ip4_addr4(&(netif->netmask)));
+    ++tapIf->txStats.drops;
+    SYS_ARCH_UNPROTECT(lev);
 
-  system(ifconfig);
+    pbuf_free(p);
+    LINK_STATS_INC(link.drop);
+    return ERR_IF;
+  }
 
-#if LWIP_IPV6
-  sprintf (ifconfig, "ifconfig tap0 inet6 -ifdisabled");
-  system(ifconfig);
+  slot = &tapIf->txRing[(tapIf->txHead + tapIf->txCount) % tapIf->txSize];
+  slot->p = p;
+#if TAPIF_VNET
+  if (hdr != NULL)
+    memcpy(&slot->vnet, hdr, sizeof(slot->vnet));
 #endif
 
-  memset(&sig, '\0', sizeof(sig));
+  wake = (tapIf->txCount == 0);
+  ++tapIf->txCount;
+  ++tapIf->txStats.queued;
+  if (tapIf->txCount > tapIf->txStats.highWater)
+    tapIf->txStats.highWater = tapIf->txCount;
 
-  sig.sa_sigaction = ioReady;
-  sig.sa_flags     = SA_RESTART | SA_SIGINFO;
+  SYS_ARCH_UNPROTECT(lev);
 
-  sigaction(SIGIO, &sig, NULL);
+  if (wake)
+    nosSemaSignal(tapIf->queue[0].sema);
+
+  return ERR_OK;
+}
 
-  fcntl(tapIf->tap, F_SETOWN, getpid());
-  flags = fcntl(tapIf->tap, F_GETFL, 0);
-  fcntl(tapIf->tap, F_SETFL, flags | O_ASYNC | O_NONBLOCK);
+/*
+ * Send frames from TX ring until it is empty or device is busy again.
+ * Frame is removed from ring only after it has been written, so
+ * lowLevelOutput never writes to device at the same time.
+ */
+static void txFlush(struct netif *netif)
+{
+  struct tapIf     *tapIf = netif->state;
+  struct tapTxSlot *slot;
+  struct pbuf      *p;
+  const void       *hdr;
+  ssize_t          len;
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  while (tapIf->txCount > 0) {
+
+    slot = &tapIf->txRing[tapIf->txHead];
+    p = slot->p;
+    hdr = NULL;
+#if TAPIF_VNET
+    if (tapIf->vnetHdr)
+      hdr = &slot->vnet;
+#endif
+
+#if ETH_PAD_SIZE
+    pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
+#endif
+
+    len = txWrite(netif, hdr, p);
+
+#if ETH_PAD_SIZE
+    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
+
+    if (len == -1 && errno == EAGAIN)
+      return;
+
+    if (len == -1)
+      LINK_STATS_INC(link.err);
+    else {
+
+      LINK_STATS_INC(link.xmit);
+      NETIF_CAPTURE_FRAME(netif, p, true);
+    }
+
+    SYS_ARCH_PROTECT(lev);
+    tapIf->txHead = (tapIf->txHead + 1) % tapIf->txSize;
+    --tapIf->txCount;
+    SYS_ARCH_UNPROTECT(lev);
+
+    pbuf_free(p);
+  }
 }
 
 /*
- * Send packet.
+ * Send packet. If device is busy, packet is queued to TX ring.
+ * Packets must not pass those that are already in ring.
  */
 static err_t lowLevelOutput(struct netif *netif, struct pbuf *p)
 {
   struct tapIf *tapIf = netif->state;
-  struct pbuf *q;
-  char        ethBuf[1514];
-  char        *bufPtr;
+  const void   *hdr;
+  bool         sent;
+  bool         queue;
+  err_t        err;
+#if TAPIF_VNET
+  struct virtio_net_hdr vnet;
+#endif
 
 #if ETH_PAD_SIZE
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
 
-  bufPtr = ethBuf;
-  for(q = p; q != NULL; q = q->next) {
+  hdr = NULL;
+#if TAPIF_VNET
+  if (tapIf->vnetHdr) {
 
-    memcpy(bufPtr, q->payload, q->len);
-    bufPtr += q->len;
+    vnetOutput(tapIf, p, &vnet);
+    hdr = &vnet;
   }
+#endif
 
-  if (write(tapIf->tap, ethBuf, p->tot_len) == -1)
-    return ERR_IF;
+  sent = false;
+  queue = false;
+  err = ERR_OK;
+  if (tapIf->txCount > 0)
+    queue = true;
+  else if (txWrite(netif, hdr, p) != -1) {
+
+    LINK_STATS_INC(link.xmit);
+    sent = true;
+  }
+  else if (errno == EAGAIN && tapIf->txRing != NULL)
+    queue = true;
+  else
+    err = ERR_IF;
 
 #if ETH_PAD_SIZE
   pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
 
-  LINK_STATS_INC(link.xmit);
+  // Ring keeps frame with padding word, like stack does.
+  if (queue)
+    err = txQueue(tapIf, p, hdr);
 
-  return ERR_OK;
+  if (sent)
+    NETIF_CAPTURE_FRAME(netif, p, true);
+
+  return err;
 }
 
 /*
- * Receive packet.
+ * Receive packet. With budget, frame is read directly into a buffer
+ * of maximum frame size. Otherwise it is read into one pool pbuf, and
+ * part that doesn't fit goes to queue jumbo buffer, from which it is
+ * copied to pool pbufs allocated for actual length. If device is empty,
+ * pbuf is kept for next read.
  */
-static struct pbuf *lowLevelInput(struct netif *netif)
+static struct pbuf *lowLevelInput(struct tapQueue *queue, bool *valid)
 {
+  struct netif  *netif = queue->netif;
   struct tapIf  *tapIf = netif->state;
-  struct pbuf   *p, *q;
+  struct pbuf   *p, *tail;
+  struct iovec  iov[3];
+  u16_t         size;
+  u16_t         headLen;
+  int           iovCount;
+  int           first;
   int           len;
-  char          ethBuf[1514];
-  char          *bufPtr;
+  char          discard[VNET_HDR_LEN + 1];
+#if TAPIF_VNET
+  struct virtio_net_hdr vnet;
+#endif
 
-  // Read the packet.
-  len = read(tapIf->tap, ethBuf, sizeof(ethBuf));
-  if (len == -1 && errno == EAGAIN)
-    return NULL;
+  *valid = true;
+  size = netif->mtu + SIZEOF_ETH_HDR + ETH_PAD_SIZE;
+  p = queue->rxSpare;
+  if (p == NULL) {
+
+    p = rxAlloc(queue, (queue->rxJumbo != NULL) ? LWIP_MIN(size, PBUF_POOL_BUFSIZE) : size);
+    if (p == NULL) {
+
+      // Queue has used its budget, leave frames to device until stack frees some.
+      if (queue->rxBufs != NULL)
+        return NULL;
+
+      // Drop the frame, short read discards rest of it.
+      if (read(queue->tap, discard, sizeof(discard)) == -1 && errno == EAGAIN)
+        return NULL;
+
+      ++queue->stats.drops;
+      LINK_STATS_INC(link.memerr);
+      LINK_STATS_INC(link.drop);
+      return NULL;
+    }
+
+    queue->rxSpare = p;
+  }
 
 #if ETH_PAD_SIZE
-  len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
+  pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
 
-  p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
-  if (p != NULL) {
+  iovCount = 0;
+#if TAPIF_VNET
+  if (tapIf->vnetHdr) {
 
-#if ETH_PAD_SIZE
-    pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len  = sizeof(vnet);
+    ++iovCount;
+  }
 #endif
 
-    bufPtr = ethBuf;
-    for(q = p; q != NULL; q = q->next) {
+  first = iovCount;
+  headLen = p->len;
+  iov[iovCount].iov_base = p->payload;
+  iov[iovCount].iov_len  = headLen;
+  ++iovCount;
 
-      memcpy(q->payload, bufPtr, q->len);
-      bufPtr += q->len;
-    }
+  if (queue->rxJumbo != NULL && headLen < size - ETH_PAD_SIZE) {
+
+    iov[iovCount].iov_base = queue->rxJumbo;
+    iov[iovCount].iov_len  = size - ETH_PAD_SIZE - headLen;
+    ++iovCount;
+  }
+
+  len = readv(queue->tap, iov, iovCount);
 
 #if ETH_PAD_SIZE
-    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+  pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
 
-    LINK_STATS_INC(link.recv);
+  if (first)
+    len -= iov[0].iov_len;
+
+  if (len <= 0)
+    return NULL;
+
+  if (len > headLen) {
+
+    tail = pbuf_alloc(PBUF_RAW, len - headLen, PBUF_POOL);
+    if (tail == NULL) {
+
+      // Keep the pbuf for next frame.
+      ++queue->stats.drops;
+      LINK_STATS_INC(link.memerr);
+      LINK_STATS_INC(link.drop);
+      return NULL;
+    }
+
+    pbuf_take(tail, queue->rxJumbo, len - headLen);
+    queue->rxSpare = NULL;
+    pbuf_cat(p, tail);
   }
   else {
 
-    LINK_STATS_INC(link.memerr);
+    queue->rxSpare = NULL;
+    pbuf_realloc(p, len + ETH_PAD_SIZE);
+  }
+
+  NETIF_CAPTURE_FRAME(netif, p, false);
+
+  ++queue->stats.frames;
+  queue->stats.bytes += len;
+
+#if TAPIF_VNET
+  if (tapIf->vnetHdr && !vnetInput(tapIf, p, &vnet)) {
+
+    *valid = false;
+    ++queue->stats.csumErrors;
+    LINK_STATS_INC(link.chkerr);
     LINK_STATS_INC(link.drop);
+    return p;
   }
+#endif
 
+  LINK_STATS_INC(link.recv);
   return p;
 }
 
 /*
  * Receive packet and pass it to lwip stack.
  */
-static bool tapIfInput(struct netif *netif)
+static bool tapIfInput(struct tapQueue *queue)
 {
-  struct tapIf *tapIf;
+  struct netif *netif = queue->netif;
   struct eth_hdr *ethhdr;
   struct pbuf *p;
+  bool valid;
 
-  tapIf = netif->state;
-
-  p = lowLevelInput(netif);
+  p = lowLevelInput(queue, &valid);
   if (p == NULL)
     return false;
 
+  if (!valid) {
+
+    pbuf_free(p);
+    return true;
+  }
+
   ethhdr = p->payload;
 
   switch (htons(ethhdr->type))
@@ -289,21 +1432,104 @@ static bool tapIfInput(struct netif *netif)
 }
 
 /*
- * Polling thread
+ * Receive at most budget frames. Returns number of frames.
+ */
+static int tapPoll(struct tapQueue *queue, int budget)
+{
+  int n;
+
+  ++queue->stats.polls;
+  for (n = 0; n < budget; n++)
+    if (!tapIfInput(queue))
+      return n;
+
+  ++queue->stats.overBudget;
+  return n;
+}
+
+/*
+ * Let other tasks run between poll passes. Drops task
+ * priority to TAPIF_SPIN_PRIO unless already done.
+ */
+static void tapSpin(bool* spinning)
+{
+  if (!*spinning) {
+
+    posTaskSetPriority(posTaskGetCurrent(), TAPIF_SPIN_PRIO);
+    *spinning = true;
+  }
+
+  posTaskYield();
+}
+
+/*
+ * Polling thread, one for each queue. After wakeup frames are
+ * received in passes limited by poll budget, yielding between them.
+ * When there was traffic, queue can be busy-polled for a while before
+ * sleeping again, so that next frame doesn't need a wakeup.
  */
 static void tapThread(void* arg)
 {
-  struct netif* netif = (struct netif*) arg;
-  struct tapIf *tapIf;
+  struct tapQueue* queue = (struct tapQueue*) arg;
+  struct tapIf*    tapIf = queue->netif->state;
+  uint64_t         idleSince;
+  VAR_t            prio;
+  bool             spinning;
+  int              n;
 
-  tapIf = netif->state;
   nosPrintf("tap start.\n");
+  prio = posTaskGetPriority(posTaskGetCurrent());
 
   while (true) {
 
-    nosSemaWait(tapIf->sema, MS(1000));
-    while (tapIfInput(netif))
-      ;
+#if TAPIF_EPOLL
+    nosSemaWait(queue->sema, INFINITE);
+    ++queue->stats.wakeups;
+#else
+    // Space in device is signaled, but check it often if frames are waiting.
+    if (nosSemaWait(queue->sema, (tapIf->txCount > 0) ? MS(10) : MS(1000)) == 0)
+      ++queue->stats.wakeups;
+#endif
+
+    if (queue == &tapIf->queue[0] && tapIf->txCount > 0)
+      txFlush(queue->netif);
+
+    spinning = false;
+    while ((n = tapPoll(queue, tapIf->pollBudget)) == tapIf->pollBudget)
+      tapSpin(&spinning);
+
+    if (n > 0 && tapIf->busyPoll > 0) {
+
+      ++queue->stats.busyPolls;
+      idleSince = sys_now_us();
+      while (sys_now_us() - idleSince < tapIf->busyPoll) {
+
+        n = tapPoll(queue, tapIf->pollBudget);
+        if (n > 0) {
+
+          queue->stats.busyFrames += n;
+          idleSince = sys_now_us();
+        }
+
+        // Queue without buffers must wait for them anyway.
+        if (queue->rxStarved)
+          break;
+
+        tapSpin(&spinning);
+      }
+    }
+
+    if (spinning)
+      posTaskSetPriority(posTaskGetCurrent(), prio);
+
+#if TAPIF_EPOLL
+    // Queue without buffers is re-armed when it gets them back.
+    if (!queue->rxStarved)
+      ioWatch(queue, EPOLL_CTL_MOD);
+
+    if (queue == &tapIf->queue[0] && tapIf->txCount > 0)
+      txWatch(tapIf);
+#endif
   }
 }
 
@@ -312,17 +1538,33 @@ static void tapThread(void* arg)
  */
 err_t tapIfInit(struct netif *netif)
 {
-  struct tapIf *tapIf;
+  const struct tapIfConfig *config;
+  struct tapIf    *tapIf;
+  struct tapQueue *queue;
+  int             queueCount;
+  int             i;
 
   LWIP_ASSERT("netif != NULL", (netif != NULL));
 
-  tapIf = mem_malloc(sizeof(struct tapIf));
+  config = netif->state;
+
+  queueCount = 1;
+#ifdef __linux__
+  // Descriptor from launcher is always a single queue.
+  if (config != NULL && config->fd <= 0 && config->queues > 1)
+    queueCount = config->queues;
+#endif
+
+  tapIf = mem_malloc(sizeof(struct tapIf) + (queueCount - 1) * sizeof(struct tapQueue));
   if (tapIf == NULL) {
 
     LWIP_DEBUGF(NETIF_DEBUG, ("tapIfInit: out of memory\n"));
     return ERR_MEM;
   }
 
+  memset(tapIf, '\0', sizeof(struct tapIf) + (queueCount - 1) * sizeof(struct tapQueue));
+  tapIf->queueCount = queueCount;
+
 #if LWIP_NETIF_HOSTNAME
   netif->hostname = "lwip";
 #endif
@@ -340,15 +1582,70 @@ err_t tapIfInit(struct netif *netif)
 
   netif->linkoutput = lowLevelOutput;
 
-  lowLevelInit(netif);
+  // Semaphores must exist before device can signal them.
+  for (i = 0; i < queueCount; i++) {
+
+    queue = &tapIf->queue[i];
+    queue->netif = netif;
+    queue->sema  = nosSemaCreate(1, 0, "tap");
+  }
+
+  if (lowLevelInit(netif, config) != ERR_OK) {
+
+    for (i = 0; i < queueCount; i++) {
+
+      queue = &tapIf->queue[i];
+      nosSemaDestroy(queue->sema);
+      if (queue->rxBufs != NULL)
+        nosMemFree(queue->rxBufs);
+
+      if (queue->rxJumbo != NULL)
+        nosMemFree(queue->rxJumbo);
+    }
+
+    if (tapIf->txCopy != NULL)
+      nosMemFree(tapIf->txCopy);
+
+    if (tapIf->txRing != NULL)
+      nosMemFree(tapIf->txRing);
+
+    netif->state = NULL;
+    mem_free(tapIf);
+    return ERR_IF;
+  }
 
   /*
-   * Create thread to poll the interface.
+   * Create threads to poll the interface queues.
    */
 
-  tapIf->sema = nosSemaCreate(1, 0, "tap");
-  tapIf->poll = nosTaskCreate(tapThread, netif, 10, 300, "cs");
-  pollSema = tapIf->sema;
+  for (i = 0; i < queueCount; i++)
+    tapIf->queue[i].poll = nosTaskCreate(tapThread, &tapIf->queue[i], 10, 300, tapIf->name);
+
+  return ERR_OK;
+}
+
+/*
+ * Get statistics for interface queue.
+ */
+err_t tapIfQueueStats(struct netif *netif, int queue, struct tapIfQueueStats *stats)
+{
+  struct tapIf *tapIf = netif->state;
+
+  if (queue < 0 || queue >= tapIf->queueCount)
+    return ERR_ARG;
+
+  *stats = tapIf->queue[queue].stats;
+  return ERR_OK;
+}
+
+/*
+ * Get statistics for interface TX ring.
+ */
+err_t tapIfTxStats(struct netif *netif, struct tapIfTxStats *stats)
+{
+  struct tapIf *tapIf = netif->state;
 
+  *stats = tapIf->txStats;
+  stats->occupancy = tapIf->txCount;
   return ERR_OK;
 }
@@ -30,160 +30,1752 @@
  */
 
 #include <picoos.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "lwip/debug.h"
 #include "lwip/sys.h"
 #include "lwip/opt.h"
 #include "lwip/stats.h"
+#if SYS_ARCH_MBOX_PRIORITY
+#include "lwip/priv/tcpip_priv.h"
+#endif
+
+#define DEFAULT_MBOX_SIZE 10
+
+#if SYS_ARCH_MBOX_PRIORITY
+
+#ifndef SYS_ARCH_MBOX_HIGH_SIZE
+#define SYS_ARCH_MBOX_HIGH_SIZE 16
+#endif
+
+#ifndef SYS_ARCH_MBOX_HIGH_BURST
+#define SYS_ARCH_MBOX_HIGH_BURST 8
+#endif
+
+#endif
+
+#define TRACK_TCPIP_THREAD (SYS_ARCH_MBOX_BATCH > 0 || SYS_ARCH_MBOX_PRIORITY)
+
+#if SYS_ARCH_MBOX_OVERFLOW
+
+struct MboxOverflow {
+
+  SysMboxOverflow      policy;
+  SysMboxOverflowFn    fn;
+  void*                arg;
+  SysMboxOverflowStats stats;
+};
+
+#endif
+
+/*
+ * Use host clock for sys_now_us() in unix port.
+ */
+#ifndef SYS_ARCH_CLOCK_GETTIME
+#if defined(__unix__) || defined(__APPLE__)
+#define SYS_ARCH_CLOCK_GETTIME 1
+#else
+#define SYS_ARCH_CLOCK_GETTIME 0
+#endif
+#endif
+
+#if SYS_ARCH_CLOCK_GETTIME
+#include <time.h>
+#endif
+
+#if SYS_ARCH_OBJECT_POOLS
+
+/*
+ * Pool sizes. Each netconn needs a semaphore and one or two
+ * mailboxes (recvmbox, plus acceptmbox for listening ones),
+ * rest are for tcpip thread and core itself.
+ */
+#ifndef SYS_ARCH_SEM_POOL_SIZE
+#define SYS_ARCH_SEM_POOL_SIZE (MEMP_NUM_NETCONN + 4)
+#endif
+
+#ifndef SYS_ARCH_MUTEX_POOL_SIZE
+#define SYS_ARCH_MUTEX_POOL_SIZE 4
+#endif
+
+#ifndef SYS_ARCH_MBOX_POOL_SIZE
+#define SYS_ARCH_MBOX_POOL_SIZE (2 * MEMP_NUM_NETCONN + 1)
+#endif
+
+/*
+ * All pooled mailboxes have same capacity, which must be enough
+ * for the largest mailbox lwIP creates. Size requested in
+ * sys_mbox_new() is stored in mailbox and enforced when posting,
+ * so smaller mailboxes still give backpressure at their own limit.
+ */
+#define MBOX_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#ifndef SYS_ARCH_MBOX_POOL_MSGS
+#define SYS_ARCH_MBOX_POOL_MSGS MBOX_MAX(MBOX_MAX(MBOX_MAX(TCPIP_MBOX_SIZE,           \
+                                                           DEFAULT_TCP_RECVMBOX_SIZE), \
+                                                  MBOX_MAX(DEFAULT_UDP_RECVMBOX_SIZE,  \
+                                                           DEFAULT_RAW_RECVMBOX_SIZE)),\
+                                         MBOX_MAX(DEFAULT_ACCEPTMBOX_SIZE,             \
+                                                  DEFAULT_MBOX_SIZE))
+#endif
+
+/*
+ * Fixed-size pool of preallocated objects. Objects are created
+ * once in sys_init() and recycled after that, so creating and
+ * deleting netconns never goes to heap.
+ */
+typedef struct {
+
+  void**       objs;
+  int          free;
+  SysPoolStats stats;
+} SysPool;
+
+static void*   semObjs[SYS_ARCH_SEM_POOL_SIZE];
+static void*   mutexObjs[SYS_ARCH_MUTEX_POOL_SIZE];
+static void*   mboxObjs[SYS_ARCH_MBOX_POOL_SIZE];
+
+static SysPool semPool   = { .objs = semObjs };
+static SysPool mutexPool = { .objs = mutexObjs };
+static SysPool mboxPool  = { .objs = mboxObjs };
+
+static void poolAdd(SysPool* pool, void* obj)
+{
+  if (obj == NULL)
+    return;
+
+  pool->objs[pool->free++] = obj;
+  pool->stats.size++;
+}
+
+static void* poolGet(SysPool* pool)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  void* obj;
+
+  SYS_ARCH_PROTECT(flags);
+  if (pool->free == 0) {
+
+    pool->stats.failures++;
+    obj = NULL;
+  }
+  else {
+
+    obj = pool->objs[--pool->free];
+    pool->stats.used++;
+    if (pool->stats.used > pool->stats.peak)
+      pool->stats.peak = pool->stats.used;
+  }
+
+  SYS_ARCH_UNPROTECT(flags);
+  return obj;
+}
+
+static void poolPut(SysPool* pool, void* obj)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  SYS_ARCH_PROTECT(flags);
+  pool->objs[pool->free++] = obj;
+  pool->stats.used--;
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+/*
+ * Get pool statistics. Any of the pointers can be NULL.
+ */
+void sys_arch_pool_stats(SysPoolStats* sem, SysPoolStats* mutex, SysPoolStats* mbox)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  SYS_ARCH_PROTECT(flags);
+  if (sem != NULL)
+    *sem = semPool.stats;
+
+  if (mutex != NULL)
+    *mutex = mutexPool.stats;
+
+  if (mbox != NULL)
+    *mbox = mboxPool.stats;
+
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+#endif /* SYS_ARCH_OBJECT_POOLS */
+
+/*
+ * Calculate the waited time. We make sure that the calculated 
+ * time is never zero. Otherwise, when there is high traffic on
+ * this semaphore, this function may always return with zero
+ * and a sys.c-timer may never expire.
+ */
+static u32_t waitedTime(JIF_t start, u32_t timeout)
+{
+  u32_t w;
+
+  w = (u32_t) (jiffies - start) * 1000;
+  w = w / HZ;
+  if (w < (1000 / HZ))
+    w = (HZ < 500) ? (500 / HZ) : 1;
+
+  return (w < timeout) ? w : timeout;
+}
+
+#if SYS_ARCH_STATS
+
+/*
+ * Instrumentation. Each semaphore, mutex and mailbox in use is kept
+ * in a list together with its statistics, so that they can be
+ * queried by name. Names are like the ones used in
+ * nano layer registry, "lwip_s" + number for semaphores,
+ * "lwip_m" for mutexes and "lwip_q" for mailboxes.
+ */
+typedef struct SysStatsObj {
+
+  struct SysStatsObj* next;
+  struct SysStatsObj* prev;
+  SysObjStats         stats;
+} SysStatsObj;
+
+struct SysSem {
+
+  NOSSEMA_t   sema;
+  SysStatsObj obj;
+};
+
+struct SysMutex {
+
+  NOSMUTEX_t  mutex;
+  SysStatsObj obj;
+  int         lockDepth;
+  uint64_t    lockedAt;
+};
+
+#define SEMA(s)  ((s)->sema)
+#define MUTEX(m) ((m)->mutex)
+
+static SysStatsObj* statsList;
+static u32_t        statsSeq;
+
+static void statsAttach(SysStatsObj* obj, char kind)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  u32_t seq;
+  char* ptr;
+  char  num[11];
+  int   i;
+
+  memset(&obj->stats, '\0', sizeof(obj->stats));
+
+  SYS_ARCH_PROTECT(flags);
+  seq = ++statsSeq;
+  obj->prev = NULL;
+  obj->next = statsList;
+  if (statsList != NULL)
+    statsList->prev = obj;
+
+  statsList = obj;
+  SYS_ARCH_UNPROTECT(flags);
+
+  strcpy(obj->stats.name, "lwip_");
+  ptr = obj->stats.name + strlen(obj->stats.name);
+  *ptr++ = kind;
+
+  i = 0;
+  do {
+
+    num[i++] = '0' + seq % 10;
+    seq = seq / 10;
+  } while (seq > 0);
+
+  while (i > 0)
+    *ptr++ = num[--i];
+
+  *ptr = '\0';
+}
+
+static void statsDetach(SysStatsObj* obj)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  SYS_ARCH_PROTECT(flags);
+  if (obj->prev != NULL)
+    obj->prev->next = obj->next;
+  else
+    statsList = obj->next;
+
+  if (obj->next != NULL)
+    obj->next->prev = obj->prev;
+
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+/*
+ * Record time spent waiting. Histogram buckets are
+ * < 10 us, < 100 us, < 1 ms and so on.
+ */
+static void statsWait(SysStatsObj* obj, uint64_t start, bool timeout)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  u32_t us = (u32_t) (sys_now_us() - start);
+  u32_t limit = 10;
+  int   b = 0;
+
+  while (b < SYS_ARCH_STATS_BUCKETS - 1 && us >= limit) {
+
+    ++b;
+    limit = limit * 10;
+  }
+
+  SYS_ARCH_PROTECT(flags);
+  obj->stats.waits++;
+  obj->stats.waitHist[b]++;
+  if (us > obj->stats.maxWaitUs)
+    obj->stats.maxWaitUs = us;
+
+  if (timeout)
+    obj->stats.timeouts++;
+
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+/*
+ * Track number of messages in mailbox.
+ */
+static void statsDepth(SysStatsObj* obj, int change)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  SYS_ARCH_PROTECT(flags);
+  obj->stats.depth += change;
+  if (obj->stats.depth > obj->stats.maxDepth)
+    obj->stats.maxDepth = obj->stats.depth;
+
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+static bool statsMatch(const char* name, const char* pattern)
+{
+  int len;
+
+  if (pattern == NULL)
+    return true;
+
+  len = strlen(pattern);
+  if (len > 0 && pattern[len - 1] == '*')
+    return !strncmp(name, pattern, len - 1);
+
+  return !strcmp(name, pattern);
+}
+
+/*
+ * Copy statistics of objects whose name matches pattern.
+ * Pattern is either exact name or prefix ending with '*'.
+ * First matches are skipped, and at most max entries are
+ * copied. Returns number of entries copied.
+ */
+int sys_arch_stats_query(const char* pattern, int first, SysObjStats* out, int max)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  SysStatsObj* obj;
+  int          n = 0;
+
+  SYS_ARCH_PROTECT(flags);
+  for (obj = statsList; obj != NULL && n < max; obj = obj->next) {
+
+    if (!statsMatch(obj->stats.name, pattern))
+      continue;
+
+    if (first > 0) {
+
+      --first;
+      continue;
+    }
+
+    out[n++] = obj->stats;
+  }
+
+  SYS_ARCH_UNPROTECT(flags);
+  return n;
+}
+
+/*
+ * Print statistics of matching objects.
+ */
+void sys_arch_stats_dump(const char* pattern)
+{
+  SysObjStats st;
+  int         i;
+  int         b;
+
+  nosPrintf("%-10s %8s %8s %8s %8s %5s %5s %8s  wait histogram (10us..1s)\n",
+            "name", "waits", "timeouts", "maxwait", "maxhold", "depth", "max", "postfail");
+
+  for (i = 0; sys_arch_stats_query(pattern, i, &st, 1) == 1; i++) {
+
+    nosPrintf("%-10s %8lu %8lu %8lu %8lu %5u %5u %8lu ",
+              st.name,
+              (unsigned long) st.waits,
+              (unsigned long) st.timeouts,
+              (unsigned long) st.maxWaitUs,
+              (unsigned long) st.maxHoldUs,
+              (unsigned) st.depth,
+              (unsigned) st.maxDepth,
+              (unsigned long) st.postFailures);
+
+    for (b = 0; b < SYS_ARCH_STATS_BUCKETS; b++)
+      nosPrintf(" %lu", (unsigned long) st.waitHist[b]);
+
+    nosPrintf("\n");
+  }
+}
+
+#else
+
+#define SEMA(s)  (s)
+#define MUTEX(m) (m)
+
+#endif /* SYS_ARCH_STATS */
+
+/*
+ * Create and destroy operating system objects.
+ */
+static sys_sem_t semCreate(u8_t count)
+{
+#if SYS_ARCH_STATS
+  struct SysSem* sem;
+
+  sem = nosMemAlloc(sizeof(struct SysSem));
+  if (sem == NULL)
+    return NULL;
+
+  sem->sema = nosSemaCreate(count, 0, "lwip_s*");
+  if (sem->sema == NULL) {
+
+    nosMemFree(sem);
+    return NULL;
+  }
+
+  return sem;
+#else
+  return nosSemaCreate(count, 0, "lwip_s*");
+#endif
+}
+
+static sys_mutex_t mutexCreate(void)
+{
+#if SYS_ARCH_STATS
+  struct SysMutex* mutex;
+
+  mutex = nosMemAlloc(sizeof(struct SysMutex));
+  if (mutex == NULL)
+    return NULL;
+
+  mutex->mutex = nosMutexCreate(0, "lwip_m*");
+  if (mutex->mutex == NULL) {
+
+    nosMemFree(mutex);
+    return NULL;
+  }
+
+  mutex->lockDepth = 0;
+  return mutex;
+#else
+  return nosMutexCreate(0, "lwip_m*");
+#endif
+}
+
+#if !SYS_ARCH_OBJECT_POOLS
+
+static void semDestroy(sys_sem_t sem)
+{
+  nosSemaDestroy(SEMA(sem));
+#if SYS_ARCH_STATS
+  nosMemFree(sem);
+#endif
+}
+
+static void mutexDestroy(sys_mutex_t mutex)
+{
+  nosMutexDestroy(MUTEX(mutex));
+#if SYS_ARCH_STATS
+  nosMemFree(mutex);
+#endif
+}
+
+#endif
+
+/*
+ * Mutex implementation uses Pico]OS nano layer mutex api directly.
+ */
+
+err_t sys_mutex_new(sys_mutex_t *mutex)
+{
+#if SYS_ARCH_OBJECT_POOLS
+  *mutex = poolGet(&mutexPool);
+#else
+  *mutex = mutexCreate();
+#endif
+  if (*mutex == NULL) {
+
+    SYS_STATS_INC(mutex.err);
+    return ERR_MEM;
+  }
+  
+#if SYS_ARCH_STATS
+  statsAttach(&(*mutex)->obj, 'm');
+#endif
+
+  SYS_STATS_INC_USED(mutex);
+  return ERR_OK;
+}
+
+void sys_mutex_lock(sys_mutex_t *mutex)
+{
+#if SYS_ARCH_STATS
+  struct SysMutex* m = *mutex;
+  uint64_t         start = sys_now_us();
+
+  nosMutexLock(m->mutex);
+  if (m->lockDepth++ == 0) {
+
+    statsWait(&m->obj, start, false);
+    m->lockedAt = sys_now_us();
+  }
+#else
+  nosMutexLock(*mutex);
+#endif
+}
+
+void sys_mutex_unlock(sys_mutex_t *mutex)
+{
+#if SYS_ARCH_STATS
+  struct SysMutex* m = *mutex;
+  u32_t            hold;
+
+  if (--m->lockDepth == 0) {
+
+    hold = (u32_t) (sys_now_us() - m->lockedAt);
+    if (hold > m->obj.stats.maxHoldUs)
+      m->obj.stats.maxHoldUs = hold;
+  }
+
+  nosMutexUnlock(m->mutex);
+#else
+  nosMutexUnlock(*mutex);
+#endif
+}
+
+void sys_mutex_free(sys_mutex_t *mutex)
+{
+#if SYS_ARCH_STATS
+  statsDetach(&(*mutex)->obj);
+#endif
+
+#if SYS_ARCH_OBJECT_POOLS
+  poolPut(&mutexPool, *mutex);
+#else
+  mutexDestroy(*mutex);
+#endif
+  SYS_STATS_DEC(mutex.used);
+}
+
+/*
+ * Semaphore implementation uses Pico]OS nano layer semphore api directly.
+ */
+
+err_t sys_sem_new(sys_sem_t *sem, u8_t count)
+{
+#if SYS_ARCH_OBJECT_POOLS
+  *sem = poolGet(&semPool);
+  if (*sem != NULL)
+    while (count-- > 0)
+      nosSemaSignal(SEMA(*sem));
+#else
+  *sem = semCreate(count);
+#endif
+  if (*sem == NULL) {
+
+    SYS_STATS_INC(sem.err);
+    return ERR_MEM;
+  }
+  
+#if SYS_ARCH_STATS
+  statsAttach(&(*sem)->obj, 's');
+#endif
+
+  SYS_STATS_INC_USED(sem);
+  return ERR_OK;
+}
+
+void sys_sem_signal(sys_sem_t *sem)
+{
+  nosSemaSignal(SEMA(*sem));
+}
+
+u32_t sys_arch_sem_wait(sys_sem_t *sem, u32_t timeout)
+{
+  JIF_t start = jiffies;
+  bool  ok;
+
+#if SYS_ARCH_STATS
+  uint64_t startUs = sys_now_us();
+#endif
+
+  ok = nosSemaWait(SEMA(*sem), (timeout == 0) ? INFINITE : (UINT_t) MS(timeout)) == 0;
+
+#if SYS_ARCH_STATS
+  statsWait(&(*sem)->obj, startUs, !ok);
+#endif
+
+  if (!ok)
+    return SYS_ARCH_TIMEOUT;
+
+  return waitedTime(start, timeout);
+}
+
+void sys_sem_free(sys_sem_t *sem)
+{
+#if SYS_ARCH_STATS
+  statsDetach(&(*sem)->obj);
+#endif
+
+#if SYS_ARCH_OBJECT_POOLS
+  // Consume signals that nobody waited for before recycling.
+  while (nosSemaWait(SEMA(*sem), 0) == 0)
+    ;
+
+  poolPut(&semPool, *sem);
+#else
+  semDestroy(*sem);
+#endif
+  SYS_STATS_DEC(sem.used);
+}
+
+#if LWIP_NETCONN_SEM_PER_THREAD
+
+/*
+ * Per-thread semaphores for netconn api. Semaphore is kept in
+ * task-local storage (task control block user space by default),
+ * so task uses the same semaphore for all its socket calls.
+ * User space is not cleared when task is created, so owner field
+ * tells if current task has set up the slot. It cannot tell tasks
+ * that get a recycled control block apart: if a task exits without
+ * LWIP_NETCONN_THREAD_SEM_FREE(), next task in same control block
+ * takes over its semaphore, which is harmless because netconn
+ * calls leave it at zero.
+ */
+typedef struct {
+
+  POSTASK_t owner;
+  sys_sem_t sem;
+} TaskSem;
+
+#ifndef SYS_ARCH_TASK_SEM
+#if POSCFG_TASKCB_USERSPACE == 0
+#error LWIP_NETCONN_SEM_PER_THREAD needs POSCFG_TASKCB_USERSPACE or SYS_ARCH_TASK_SEM
+#endif
+
+typedef char TaskSemCheck[(POSCFG_TASKCB_USERSPACE >= sizeof(TaskSem)) ? 1 : -1];
+
+#define SYS_ARCH_TASK_SEM() ((TaskSem*) posTaskGetUserspace())
+#endif
+
+sys_sem_t* sys_arch_netconn_sem_get(void)
+{
+  TaskSem* ts = SYS_ARCH_TASK_SEM();
+
+  if (ts->owner != posTaskGetCurrent())
+    sys_arch_netconn_sem_alloc();
+
+  // lwIP has no way to handle a missing semaphore here.
+  LWIP_ASSERT("netconn semaphore allocation failed", ts->owner == posTaskGetCurrent());
+  return &ts->sem;
+}
+
+void sys_arch_netconn_sem_alloc(void)
+{
+  TaskSem* ts = SYS_ARCH_TASK_SEM();
+
+  if (ts->owner == posTaskGetCurrent())
+    return;
+
+  if (sys_sem_new(&ts->sem, 0) == ERR_OK)
+    ts->owner = posTaskGetCurrent();
+  else
+    sys_sem_set_invalid(&ts->sem);
+}
+
+void sys_arch_netconn_sem_free(void)
+{
+  TaskSem* ts = SYS_ARCH_TASK_SEM();
+
+  if (ts->owner != posTaskGetCurrent())
+    return;
+
+  sys_sem_free(&ts->sem);
+  sys_sem_set_invalid(&ts->sem);
+  ts->owner = NULL;
+}
+
+#endif /* LWIP_NETCONN_SEM_PER_THREAD */
+
+#if SYS_ARCH_LOCKFREE_MBOX
+
+/*
+ * Lock-free mailbox is a bounded ring of sequence-numbered cells
+ * (as in Dmitry Vyukov's bounded queue). Producers claim a cell
+ * with compare-and-swap on tail. Normally there is only one consumer
+ * (tcpip thread or netconn owner), but head is also advanced with
+ * compare-and-swap, because lwIP drains netconn mailboxes from
+ * tcpip thread while application might still be fetching.
+ *
+ * Consumer registers itself in consumersWaiting before going to
+ * sleep. Producers signal dataSema only if somebody is
+ * registered, which can happen only when mailbox is empty.
+ * Producers blocked on a full mailbox sleep on spaceSema in
+ * similar way.
+ */
+
+#if !defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4) && !defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+#error SYS_ARCH_LOCKFREE_MBOX requires CPU with atomic compare-and-swap
+#endif
+
+typedef struct {
+
+  uintptr_t seq;
+  void*     msg;
+} MboxCell;
+
+struct SysMbox {
+
+  uintptr_t tail;
+  uintptr_t head;
+  uintptr_t mask;
+  uintptr_t limit;
+  int       consumersWaiting;
+  int       producersWaiting;
+  NOSSEMA_t dataSema;
+  NOSSEMA_t spaceSema;
+#if SYS_ARCH_STATS
+  SysStatsObj obj;
+#endif
+#if SYS_ARCH_MBOX_PRIORITY
+  struct MboxLane* lane;
+#endif
+#if SYS_ARCH_MBOX_OVERFLOW
+  struct MboxOverflow overflow;
+#endif
+  MboxCell  cells[1];
+};
+
+static bool mboxPut(sys_mbox_t mbox, void* msg)
+{
+  MboxCell*  cell;
+  uintptr_t  pos;
+  uintptr_t  seq;
+  intptr_t   diff;
+
+  pos = __atomic_load_n(&mbox->tail, __ATOMIC_RELAXED);
+  while (true) {
+
+    cell = &mbox->cells[pos & mbox->mask];
+    seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0) {
+
+      // Ring can be larger than mailbox size (pooled or rounded up).
+      // Stale pos can be behind head, then CAS below fails anyway.
+      if ((intptr_t) (pos - __atomic_load_n(&mbox->head, __ATOMIC_ACQUIRE)) >= (intptr_t) mbox->limit)
+        return false;
+
+      if (__atomic_compare_exchange_n(&mbox->tail, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+      return false; // full
+    else
+      pos = __atomic_load_n(&mbox->tail, __ATOMIC_RELAXED);
+  }
+
+  cell->msg = msg;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  // Wake up consumer if it is sleeping.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mbox->consumersWaiting, __ATOMIC_RELAXED) > 0)
+    nosSemaSignal(mbox->dataSema);
+
+  return true;
+}
+
+static bool mboxGet(sys_mbox_t mbox, void** msg)
+{
+  MboxCell*  cell;
+  uintptr_t  pos;
+
+  uintptr_t  seq;
+  intptr_t   diff;
+
+  pos = __atomic_load_n(&mbox->head, __ATOMIC_RELAXED);
+  while (true) {
+
+    cell = &mbox->cells[pos & mbox->mask];
+    seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+    if (diff == 0) {
+
+      if (__atomic_compare_exchange_n(&mbox->head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+      return false; // empty, or producer has not finished yet
+    else
+      pos = __atomic_load_n(&mbox->head, __ATOMIC_RELAXED);
+  }
+
+  *msg = cell->msg;
+  __atomic_store_n(&cell->seq, pos + mbox->mask + 1, __ATOMIC_RELEASE);
+
+  // Wake up a producer if some are blocked on full mailbox.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mbox->producersWaiting, __ATOMIC_RELAXED) > 0)
+    nosSemaSignal(mbox->spaceSema);
+
+  return true;
+}
+
+/*
+ * Fetch message, waiting at most ticks for it.
+ * Semaphore might have a stale signal from a producer that raced
+ * with us, so wakeup without message just loops again.
+ */
+static bool mboxWait(sys_mbox_t mbox, void** msg, UINT_t ticks)
+{
+  JIF_t  start = jiffies;
+  UINT_t elapsed;
+  UINT_t left = ticks;
+
+  while (true) {
+
+    if (mboxGet(mbox, msg))
+      return true;
+
+    if (ticks == 0)
+      return false;
+
+    __atomic_add_fetch(&mbox->consumersWaiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (mboxGet(mbox, msg)) {
+
+      __atomic_sub_fetch(&mbox->consumersWaiting, 1, __ATOMIC_SEQ_CST);
+      return true;
+    }
+
+    if (ticks != INFINITE) {
+
+      elapsed = (UINT_t) (jiffies - start);
+      if (elapsed >= ticks)
+        left = 0;
+      else
+        left = ticks - elapsed;
+    }
+
+    if (left == 0 || nosSemaWait(mbox->dataSema, left) > 0) {
+
+      __atomic_sub_fetch(&mbox->consumersWaiting, 1, __ATOMIC_SEQ_CST);
+      return mboxGet(mbox, msg);
+    }
+
+    __atomic_sub_fetch(&mbox->consumersWaiting, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static sys_mbox_t mboxCreate(int size)
+{
+  sys_mbox_t      mbox;
+  int             cells;
+  int             i;
+
+  // Round up to power of two.
+  cells = 1;
+  while (cells < size)
+    cells = cells * 2;
+
+  mbox = nosMemAlloc(sizeof(struct SysMbox) + (cells - 1) * sizeof(MboxCell));
+  if (mbox == NULL)
+    return NULL;
+
+  mbox->head             = 0;
+  mbox->tail             = 0;
+  mbox->mask             = cells - 1;
+  mbox->limit            = size;
+  mbox->consumersWaiting = 0;
+  mbox->producersWaiting = 0;
+  for (i = 0; i < cells; i++)
+    mbox->cells[i].seq = i;
+
+  mbox->dataSema = nosSemaCreate(0, 0, "lwip_q*");
+  mbox->spaceSema = nosSemaCreate(0, 0, "lwip_q*");
+  if (mbox->dataSema == NULL || mbox->spaceSema == NULL) {
+
+    if (mbox->dataSema != NULL)
+      nosSemaDestroy(mbox->dataSema);
+
+    if (mbox->spaceSema != NULL)
+      nosSemaDestroy(mbox->spaceSema);
+
+    nosMemFree(mbox);
+    return NULL;
+  }
+
+  return mbox;
+}
+
+static void mboxPost(sys_mbox_t mbox, void* msg)
+{
+  while (!mboxPut(mbox, msg)) {
+
+    __atomic_add_fetch(&mbox->producersWaiting, 1, __ATOMIC_SEQ_CST);
+    if (mboxPut(mbox, msg)) {
+
+      __atomic_sub_fetch(&mbox->producersWaiting, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+
+    nosSemaWait(mbox->spaceSema, INFINITE);
+    __atomic_sub_fetch(&mbox->producersWaiting, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+#if !SYS_ARCH_OBJECT_POOLS
+static void mboxDestroy(sys_mbox_t mbox)
+{
+  nosSemaDestroy(mbox->dataSema);
+  nosSemaDestroy(mbox->spaceSema);
+  nosMemFree(mbox);
+}
+#endif
+
+#else
+
+/*
+ * Mailboxes use picoos-micro UosRing buffers. Ring is used
+ * directly unless some feature needs a wrapper.
+ */
+
+#if SYS_ARCH_MBOX_WRAPPER
+
+struct SysMbox {
+
+  UosRing* ring;
+#if SYS_ARCH_OBJECT_POOLS
+  int       limit;            // size requested by lwIP, ring is larger
+  int       count;
+  int       producersWaiting;
+  NOSSEMA_t spaceSema;
+#endif
+#if SYS_ARCH_STATS
+  SysStatsObj obj;
+#endif
+#if SYS_ARCH_MBOX_PRIORITY
+  struct MboxLane* lane;
+#endif
+#if SYS_ARCH_MBOX_OVERFLOW
+  struct MboxOverflow overflow;
+#endif
+};
+
+#define MBOX_RING(mbox) ((mbox)->ring)
+#else
+#define MBOX_RING(mbox) (mbox)
+#endif
+
+#if SYS_ARCH_OBJECT_POOLS
+
+/*
+ * Pooled ring is larger than mailbox, so messages are counted
+ * here and producers wait for space on spaceSema.
+ */
+static bool mboxPut(sys_mbox_t mbox, void* msg)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  SYS_ARCH_PROTECT(flags);
+  if (mbox->count >= mbox->limit) {
+
+    SYS_ARCH_UNPROTECT(flags);
+    return false;
+  }
+
+  ++mbox->count;
+  SYS_ARCH_UNPROTECT(flags);
+
+  uosRingPut(mbox->ring, &msg, 0);
+  return true;
+}
+
+static void mboxTaken(sys_mbox_t mbox)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  bool wake;
+
+  SYS_ARCH_PROTECT(flags);
+  --mbox->count;
+  wake = mbox->producersWaiting > 0;
+  SYS_ARCH_UNPROTECT(flags);
+
+  if (wake)
+    nosSemaSignal(mbox->spaceSema);
+}
+
+static bool mboxGet(sys_mbox_t mbox, void** msg)
+{
+  if (!uosRingGet(mbox->ring, msg, 0))
+    return false;
+
+  mboxTaken(mbox);
+  return true;
+}
+
+static bool mboxWait(sys_mbox_t mbox, void** msg, UINT_t ticks)
+{
+  if (!uosRingGet(mbox->ring, msg, ticks))
+    return false;
+
+  mboxTaken(mbox);
+  return true;
+}
+
+static sys_mbox_t mboxCreate(int size)
+{
+  sys_mbox_t mbox;
+
+  mbox = nosMemAlloc(sizeof(struct SysMbox));
+  if (mbox == NULL)
+    return NULL;
+
+  mbox->limit            = size;
+  mbox->count            = 0;
+  mbox->producersWaiting = 0;
+  mbox->ring = uosRingCreate(sizeof(void*), size);
+  mbox->spaceSema = nosSemaCreate(0, 0, "lwip_q*");
+  if (mbox->ring == NULL || mbox->spaceSema == NULL) {
+
+    if (mbox->ring != NULL)
+      uosRingDestroy(mbox->ring);
+
+    if (mbox->spaceSema != NULL)
+      nosSemaDestroy(mbox->spaceSema);
+
+    nosMemFree(mbox);
+    return NULL;
+  }
+
+  return mbox;
+}
+
+static void mboxPost(sys_mbox_t mbox, void* msg)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  SYS_ARCH_PROTECT(flags);
+  while (mbox->count >= mbox->limit) {
+
+    ++mbox->producersWaiting;
+    SYS_ARCH_UNPROTECT(flags);
+    nosSemaWait(mbox->spaceSema, INFINITE);
+    SYS_ARCH_PROTECT(flags);
+    --mbox->producersWaiting;
+  }
+
+  ++mbox->count;
+  SYS_ARCH_UNPROTECT(flags);
+
+  uosRingPut(mbox->ring, &msg, INFINITE);
+}
+
+#else
+
+static bool mboxPut(sys_mbox_t mbox, void* msg)
+{
+  return uosRingPut(MBOX_RING(mbox), &msg, 0);
+}
+
+static bool mboxGet(sys_mbox_t mbox, void** msg)
+{
+  return uosRingGet(MBOX_RING(mbox), msg, 0);
+}
+
+static bool mboxWait(sys_mbox_t mbox, void** msg, UINT_t ticks)
+{
+  return uosRingGet(MBOX_RING(mbox), msg, ticks);
+}
+
+static sys_mbox_t mboxCreate(int size)
+{
+#if SYS_ARCH_MBOX_WRAPPER
+  sys_mbox_t mbox;
+
+  mbox = nosMemAlloc(sizeof(struct SysMbox));
+  if (mbox == NULL)
+    return NULL;
+
+  mbox->ring = uosRingCreate(sizeof(void*), size);
+  if (mbox->ring == NULL) {
+
+    nosMemFree(mbox);
+    return NULL;
+  }
+    
+  return mbox;
+#else
+  return uosRingCreate(sizeof(void*), size);
+#endif
+}
+
+static void mboxPost(sys_mbox_t mbox, void* msg)
+{
+  uosRingPut(MBOX_RING(mbox), &msg, INFINITE);
+}
+
+static void mboxDestroy(sys_mbox_t mbox)
+{
+  uosRingDestroy(MBOX_RING(mbox));
+#if SYS_ARCH_MBOX_WRAPPER
+  nosMemFree(mbox);
+#endif
+}
+
+#endif /* SYS_ARCH_OBJECT_POOLS */
+
+#endif /* SYS_ARCH_LOCKFREE_MBOX */
+
+/*
+ * Mailbox operations common to both implementations.
+ */
+
+#if SYS_ARCH_STATS
+
+static void statsPostFailure(SysStatsObj* obj)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  SYS_ARCH_PROTECT(flags);
+  obj->stats.postFailures++;
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+#define MBOX_STATS_START()             uint64_t startUs = sys_now_us()
+#define MBOX_STATS_WAIT(mbox, timeout) statsWait(&(mbox)->obj, startUs, timeout)
+#define MBOX_STATS_DEPTH(mbox, change) statsDepth(&(mbox)->obj, change)
+#define MBOX_STATS_POST_FAILURE(mbox)  statsPostFailure(&(mbox)->obj)
+#else
+#define MBOX_STATS_START()
+#define MBOX_STATS_WAIT(mbox, timeout)
+#define MBOX_STATS_DEPTH(mbox, change)
+#define MBOX_STATS_POST_FAILURE(mbox)
+#endif
+
+#if TRACK_TCPIP_THREAD
+
+static sys_thread_t tcpipThread;
+
+static bool inTcpipThread(void)
+{
+  return tcpipThread != NULL && (sys_thread_t) posTaskGetCurrent() == tcpipThread;
+}
+
+#endif
+
+#if SYS_ARCH_MBOX_PRIORITY
+
+/*
+ * Priority lane for tcpip thread mailbox. Api calls and
+ * callbacks are put into a small high priority lane, so they
+ * don't have to wait behind packet input. Lane is created
+ * when tcpip thread fetches from mailbox first time.
+ *
+ * Consumer might be sleeping on normal lane, so a wakeup token
+ * is posted there when needed. Consumer clears tokenQueued each
+ * time it finds high lane empty, after that next high priority
+ * message posts a new token. If normal lane is full, token
+ * is not needed because consumer is busy anyway.
+ *
+ * If high lane is full, message goes to normal lane. Later high
+ * priority messages follow it there until all spilled ones have been
+ * fetched, so they are always handled in order they were posted.
+ * At most SYS_ARCH_MBOX_HIGH_BURST high priority messages are
+ * fetched in row while normal lane has messages waiting, unless
+ * there are spilled messages behind the ones in high lane.
+ */
+typedef struct MboxLane {
+
+  void* msgs[SYS_ARCH_MBOX_HIGH_SIZE];
+  int   first;
+  int   count;
+  int   burst;
+  int   spilled;   // high priority messages in normal lane
+  bool  tokenQueued;
+} MboxLane;
+
+static char laneToken;
+
+static bool laneHighPriority(void* msg)
+{
+#if LWIP_TCPIP_CORE_LOCKING_INPUT
+  // No packets in mailbox, lanes don't help.
+  return false;
+#else
+  return ((struct tcpip_msg*) msg)->type != TCPIP_MSG_INPKT;
+#endif
+}
+
+static void laneCreate(sys_mbox_t mbox)
+{
+  MboxLane* lane;
+
+  lane = nosMemAlloc(sizeof(MboxLane));
+  if (lane == NULL)
+    return;
+
+  memset(lane, '\0', sizeof(MboxLane));
+  mbox->lane = lane;
+}
+
+static bool lanePost(sys_mbox_t mbox, void* msg)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  MboxLane* lane = mbox->lane;
+  bool      wakeup;
+
+  if (lane == NULL || !laneHighPriority(msg))
+    return false;
+
+  SYS_ARCH_PROTECT(flags);
+  if (lane->count == SYS_ARCH_MBOX_HIGH_SIZE || lane->spilled > 0) {
+
+    lane->spilled++;
+    SYS_ARCH_UNPROTECT(flags);
+    return false;
+  }
+
+  lane->msgs[(lane->first + lane->count) % SYS_ARCH_MBOX_HIGH_SIZE] = msg;
+  lane->count++;
+  wakeup = !lane->tokenQueued;
+  lane->tokenQueued = true;
+  SYS_ARCH_UNPROTECT(flags);
+
+  if (wakeup)
+    mboxPut(mbox, &laneToken);
+
+  return true;
+}
+
+/*
+ * Spilled message was taken from normal lane or it
+ * never got there.
+ */
+static void laneSpillDone(sys_mbox_t mbox, void* msg)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  MboxLane* lane = mbox->lane;
+
+  if (lane == NULL || msg == &laneToken || !laneHighPriority(msg))
+    return;
+
+  SYS_ARCH_PROTECT(flags);
+  if (lane->spilled > 0)
+    lane->spilled--;
+
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+static bool laneGet(MboxLane* lane, void** msg)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+  bool got = false;
+
+  SYS_ARCH_PROTECT(flags);
+  if (lane->count > 0) {
+
+    *msg = lane->msgs[lane->first];
+    lane->first = (lane->first + 1) % SYS_ARCH_MBOX_HIGH_SIZE;
+    lane->count--;
+    got = true;
+  }
+  else
+    lane->tokenQueued = false;
+
+  SYS_ARCH_UNPROTECT(flags);
+  return got;
+}
+
+/*
+ * Take high priority message, unless burst limit has been reached.
+ */
+static bool laneGetHigh(MboxLane* lane, void** msg)
+{
+  if ((lane->burst >= SYS_ARCH_MBOX_HIGH_BURST && lane->spilled == 0) || !laneGet(lane, msg))
+    return false;
+
+  lane->burst++;
+  return true;
+}
+
+/*
+ * Get message from either lane without blocking.
+ */
+static bool laneGetAny(sys_mbox_t mbox, void** msg)
+{
+  MboxLane* lane = mbox->lane;
+
+  if (lane == NULL)
+    return mboxGet(mbox, msg);
+
+  if (laneGetHigh(lane, msg))
+    return true;
+
+  while (mboxGet(mbox, msg)) {
+
+    if (*msg != &laneToken) {
+
+      laneSpillDone(mbox, *msg);
+      lane->burst = 0;
+      return true;
+    }
+  }
+
+  // Normal lane is empty, no need to limit high lane.
+  lane->burst = 0;
+  return laneGet(lane, msg);
+}
+
+/*
+ * Wait for message from either lane.
+ */
+static bool laneWaitAny(sys_mbox_t mbox, void** msg, UINT_t ticks)
+{
+  JIF_t  start = jiffies;
+  JIF_t  waited;
+
+  if (mbox->lane == NULL)
+    return mboxWait(mbox, msg, ticks);
+
+  while (true) {
 
-#define DEFAULT_MBOX_SIZE 10
+    if (laneGetAny(mbox, msg))
+      return true;
 
-/*
- * Mutex implementation uses Pico]OS nano layer mutex api directly.
- */
+    if (!mboxWait(mbox, msg, ticks))
+      return false;
 
-err_t sys_mutex_new(sys_mutex_t *mutex)
-{
-  *mutex = nosMutexCreate(0, "lwip_m*");
-  if (*mutex == NULL)
-    return ERR_MEM;
-  
-  return ERR_OK;
-}
+    if (*msg != &laneToken) {
 
-void sys_mutex_lock(sys_mutex_t *mutex)
-{
-  nosMutexLock(*mutex);
-}
+      laneSpillDone(mbox, *msg);
+      mbox->lane->burst = 0;
+      return true;
+    }
 
-void sys_mutex_unlock(sys_mutex_t *mutex)
-{
-  nosMutexUnlock(*mutex);
-}
+    // Woken up by token, check high lane again.
+    if (ticks != INFINITE) {
 
-void sys_mutex_free(sys_mutex_t *mutex)
-{
-  nosMutexDestroy(*mutex);
+      waited = jiffies - start;
+      if (waited >= ticks)
+        return false;
+
+      ticks -= waited;
+      start += waited;
+    }
+  }
 }
 
+#define MBOX_GET(mbox, msg)         laneGetAny(mbox, msg)
+#define MBOX_WAIT(mbox, msg, ticks) laneWaitAny(mbox, msg, ticks)
+#else
+#define MBOX_GET(mbox, msg)         mboxGet(mbox, msg)
+#define MBOX_WAIT(mbox, msg, ticks) mboxWait(mbox, msg, ticks)
+#endif
+
+#if SYS_ARCH_MBOX_OVERFLOW
+
 /*
- * Semaphore implementation uses Pico]OS nano layer semphore api directly.
+ * Overflow policies for sys_mbox_post.
  */
-
-err_t sys_sem_new(sys_sem_t *sem, u8_t count)
+static void overflowCount(u32_t* counter)
 {
-  *sem = nosSemaCreate(count, 0, "lwip_s*");
-  if (*sem == NULL)
-    return ERR_MEM;
-  
-  return ERR_OK;
-}
+  SYS_ARCH_DECL_PROTECT(flags);
 
-void sys_sem_signal(sys_sem_t *sem)
-{
-  nosSemaSignal(*sem);
+  SYS_ARCH_PROTECT(flags);
+  ++*counter;
+  SYS_ARCH_UNPROTECT(flags);
 }
 
-u32_t sys_arch_sem_wait(sys_sem_t *sem, u32_t timeout)
+static void overflowPost(sys_mbox_t* mb, void* msg)
 {
-  JIF_t start = jiffies;
-  u32_t w;
+  sys_mbox_t           mbox = *mb;
+  struct MboxOverflow* ov = &mbox->overflow;
+  void*                old;
 
-  if (nosSemaWait(*sem, (timeout == 0) ? INFINITE : (UINT_t) MS(timeout)) > 0)
-    return SYS_ARCH_TIMEOUT;
+  while (!mboxPut(mbox, msg)) {
 
-  /* Calculate the waited time. We make sure that the calculated 
-     time is never zero. Otherwise, when there is high traffic on
-     this semaphore, this function may always return with zero
-     and a sys.c-timer may never expire. */
+    switch (ov->policy) {
+    case SYS_MBOX_OVERFLOW_BLOCK:
+      overflowCount(&ov->stats.blocked);
+      mboxPost(mbox, msg);
+      return;
 
-  w = (u32_t) (jiffies - start) * 1000;
-  w = w / HZ;
-  if (w < (1000 / HZ))
-    w = (HZ < 500) ? (500 / HZ) : 1;
+    case SYS_MBOX_OVERFLOW_DROP_NEWEST:
+      overflowCount(&ov->stats.droppedNewest);
+      MBOX_STATS_DEPTH(mbox, -1);
+#if SYS_ARCH_MBOX_PRIORITY
+      laneSpillDone(mbox, msg);
+#endif
+      if (ov->fn != NULL)
+        ov->fn(mb, msg, ov->arg);
 
-  return (w < timeout) ? w : timeout;
+      return;
+
+    case SYS_MBOX_OVERFLOW_DROP_OLDEST:
+      // Consumer might empty mailbox meanwhile, so just try again if nothing is got.
+      if (mboxGet(mbox, &old)) {
+
+#if SYS_ARCH_MBOX_PRIORITY
+        if (old == &laneToken)
+          break;
+
+        laneSpillDone(mbox, old);
+#endif
+        overflowCount(&ov->stats.droppedOldest);
+        MBOX_STATS_DEPTH(mbox, -1);
+        if (ov->fn != NULL)
+          ov->fn(mb, old, ov->arg);
+      }
+
+      break;
+
+    case SYS_MBOX_OVERFLOW_CALLBACK:
+      overflowCount(&ov->stats.callbacks);
+      MBOX_STATS_DEPTH(mbox, -1);
+#if SYS_ARCH_MBOX_PRIORITY
+      laneSpillDone(mbox, msg);
+#endif
+      ov->fn(mb, msg, ov->arg);
+      return;
+    }
+  }
 }
 
-void sys_sem_free(sys_sem_t *sem)
+void sys_arch_mbox_set_overflow(sys_mbox_t *mb, SysMboxOverflow policy, SysMboxOverflowFn fn, void *arg)
+{
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  LWIP_ASSERT("invalid mbox", (mb != NULL) && (*mb != NULL));
+  LWIP_ASSERT("overflow callback missing", policy != SYS_MBOX_OVERFLOW_CALLBACK || fn != NULL);
+
+  SYS_ARCH_PROTECT(flags);
+  (*mb)->overflow.policy = policy;
+  (*mb)->overflow.fn     = fn;
+  (*mb)->overflow.arg    = arg;
+  SYS_ARCH_UNPROTECT(flags);
+}
+
+void sys_arch_mbox_overflow_stats(sys_mbox_t *mb, SysMboxOverflowStats *st)
 {
-  nosSemaDestroy(*sem);
+  SYS_ARCH_DECL_PROTECT(flags);
+
+  LWIP_ASSERT("invalid mbox", (mb != NULL) && (*mb != NULL));
+
+  SYS_ARCH_PROTECT(flags);
+  *st = (*mb)->overflow.stats;
+  SYS_ARCH_UNPROTECT(flags);
 }
 
-/*
- * Mailboxes use picoos-micro UosRing buffers.
- */
+#endif
 
 err_t sys_mbox_new(sys_mbox_t *mb, int size)
 {
   if (size == 0)
     size = DEFAULT_MBOX_SIZE;
 
-  *mb = uosRingCreate(sizeof(void*), size);
-  if (*mb == NULL)
+#if SYS_ARCH_OBJECT_POOLS
+  LWIP_ASSERT("mbox too large for pool", size <= SYS_ARCH_MBOX_POOL_MSGS);
+  *mb = (size <= SYS_ARCH_MBOX_POOL_MSGS) ? poolGet(&mboxPool) : NULL;
+  if (*mb != NULL)
+    (*mb)->limit = size;
+#else
+  *mb = mboxCreate(size);
+#endif
+  if (*mb == NULL) {
+
+    SYS_STATS_INC(mbox.err);
     return ERR_MEM;
-    
+  }
+
+#if SYS_ARCH_STATS
+  statsAttach(&(*mb)->obj, 'q');
+#endif
+
+#if SYS_ARCH_MBOX_PRIORITY
+  (*mb)->lane = NULL;
+#endif
+
+#if SYS_ARCH_MBOX_OVERFLOW
+  memset(&(*mb)->overflow, '\0', sizeof((*mb)->overflow));
+  (*mb)->overflow.policy = SYS_MBOX_OVERFLOW_BLOCK;
+#endif
+
   SYS_STATS_INC_USED(mbox);
   return ERR_OK;
 }
 
+/*
+ * Depth is increased before posting, so that consumer
+ * never sees it going below zero. This means that depth
+ * includes also posters blocked on a full mailbox.
+ */
 void sys_mbox_post(sys_mbox_t *mb, void *msg)
 {
   LWIP_ASSERT("invalid mbox", (mb != NULL) && (*mb != NULL));
 
-  uosRingPut(*mb, &msg, INFINITE);
+#if SYS_ARCH_MBOX_OVERFLOW
+  overflowCount(&(*mb)->overflow.stats.posts);
+#endif
+
+  MBOX_STATS_DEPTH(*mb, 1);
+#if SYS_ARCH_MBOX_PRIORITY
+  if (lanePost(*mb, msg))
+    return;
+#endif
+
+#if SYS_ARCH_MBOX_OVERFLOW
+  overflowPost(mb, msg);
+#else
+  mboxPost(*mb, msg);
+#endif
 }
 
 err_t sys_mbox_trypost(sys_mbox_t *mb, void *msg)
 {
   LWIP_ASSERT("invalid mbox", (mb != NULL) && (*mb != NULL));
 
-  if (!uosRingPut(*mb, &msg, 0))
+  MBOX_STATS_DEPTH(*mb, 1);
+#if SYS_ARCH_MBOX_PRIORITY
+  if (lanePost(*mb, msg))
+    return ERR_OK;
+#endif
+
+  if (!mboxPut(*mb, msg)) {
+
+#if SYS_ARCH_MBOX_PRIORITY
+    laneSpillDone(*mb, msg);
+#endif
+    MBOX_STATS_DEPTH(*mb, -1);
+    MBOX_STATS_POST_FAILURE(*mb);
     return ERR_MEM;
+  }
 
   return ERR_OK;
 }
 
+#if SYS_ARCH_MBOX_BATCH > 0
+
+/*
+ * Messages fetched from tcpip thread mailbox are taken in batches.
+ * Batch is kept here and handed out one by one to lwIP
+ * tcpip loop, so a burst of packets costs one blocking wait
+ * instead of one per packet. Only tcpip thread touches these.
+ */
+static sys_mbox_t      batchMbox;
+static void*           batchMsgs[SYS_ARCH_MBOX_BATCH];
+static int             batchNext;
+static int             batchCount;
+#if SYS_ARCH_MBOX_PRIORITY
+static int             batchHigh;   // high priority messages left in batch
+#endif
+
+static void* batchTake(void)
+{
+  void* msg = batchMsgs[batchNext++];
+
+#if SYS_ARCH_MBOX_PRIORITY
+  if (laneHighPriority(msg))
+    --batchHigh;
+#endif
+  return msg;
+}
+
+static bool batchGet(sys_mbox_t mbox, void** msg)
+{
+  if (batchNext == batchCount || batchMbox != mbox)
+    return false;
+
+#if SYS_ARCH_MBOX_PRIORITY
+  // Let high priority messages overtake the batch, unless there are older ones in it.
+  if (mbox->lane != NULL && batchHigh == 0 && laneGetHigh(mbox->lane, msg)) {
+
+    MBOX_STATS_DEPTH(mbox, -1);
+    return true;
+  }
+
+  if (mbox->lane != NULL)
+    mbox->lane->burst = 0;
+#endif
+
+  *msg = batchTake();
+  return true;
+}
+
+#endif
+
 u32_t sys_arch_mbox_fetch(sys_mbox_t *mb, void **msg, u32_t timeout)
 {
   LWIP_ASSERT("invalid mbox", (mb != NULL) && (*mb != NULL));
 
   JIF_t start = jiffies;
-  u32_t w;
 
-  if (!uosRingGet(*mb, msg, (timeout == 0) ? INFINITE : (UINT_t) MS(timeout)) > 0)
-    return SYS_ARCH_TIMEOUT;
+#if SYS_ARCH_MBOX_PRIORITY
+  if ((*mb)->lane == NULL && inTcpipThread())
+    laneCreate(*mb);
+#endif
 
-  /* Calculate the waited time. We make sure that the calculated 
-     time is never zero. Otherwise, when there is high traffic on
-     this semaphore, this function may always return with zero
-     and a sys.c-timer may never expire. */
+#if SYS_ARCH_MBOX_BATCH > 0
+  // Pending batch belongs to another mailbox, don't overwrite it.
+  if (inTcpipThread() && (batchNext == batchCount || batchMbox == *mb)) {
 
-  w = (u32_t) (jiffies - start) * 1000;
-  w = w / HZ;
-  if (w < (1000 / HZ))
-    w = (HZ < 500) ? (500 / HZ) : 1;
+    int count;
 
-  return (w < timeout) ? w : timeout;
+    if (batchGet(*mb, msg))
+      return waitedTime(start, timeout);
+
+    count = SYS_ARCH_MBOX_BATCH;
+    if (sys_arch_mbox_fetch_many(mb, batchMsgs, &count, timeout) == SYS_ARCH_TIMEOUT)
+      return SYS_ARCH_TIMEOUT;
+
+    batchMbox  = *mb;
+    batchCount = count;
+    batchNext  = 0;
+#if SYS_ARCH_MBOX_PRIORITY
+    batchHigh  = 0;
+    while (count > 0)
+      if (laneHighPriority(batchMsgs[--count]))
+        ++batchHigh;
+#endif
+    *msg = batchTake();
+    return waitedTime(start, timeout);
+  }
+#endif
+
+  MBOX_STATS_START();
+
+  if (!MBOX_WAIT(*mb, msg, (timeout == 0) ? INFINITE : (UINT_t) MS(timeout))) {
+
+    MBOX_STATS_WAIT(*mb, true);
+    return SYS_ARCH_TIMEOUT;
+  }
+
+  MBOX_STATS_WAIT(*mb, false);
+  MBOX_STATS_DEPTH(*mb, -1);
+  return waitedTime(start, timeout);
 }
 
 u32_t sys_arch_mbox_tryfetch(sys_mbox_t *mb, void **msg)
 {
   LWIP_ASSERT("invalid mbox", (mb != NULL) && (*mb != NULL));
 
-  if (!uosRingGet(*mb, msg, 0))
+#if SYS_ARCH_MBOX_BATCH > 0
+  if (inTcpipThread() && batchGet(*mb, msg))
+    return 0;
+#endif
+
+  if (!MBOX_GET(*mb, msg))
     return SYS_MBOX_EMPTY;
 
+  MBOX_STATS_DEPTH(*mb, -1);
   return 0;
 }
 
+/*
+ * Fetch up to *count messages with one wakeup. Waits for first message
+ * like sys_arch_mbox_fetch and then takes whatever else is
+ * already pending without blocking. Number of messages
+ * fetched is returned in *count.
+ */
+u32_t sys_arch_mbox_fetch_many(sys_mbox_t *mb, void **msgs, int *count, u32_t timeout)
+{
+  LWIP_ASSERT("invalid mbox", (mb != NULL) && (*mb != NULL));
+  LWIP_ASSERT("invalid count", (count != NULL) && (*count > 0));
+
+  JIF_t start = jiffies;
+  int   max = *count;
+  int   n;
+
+  MBOX_STATS_START();
+
+  *count = 0;
+  if (!MBOX_WAIT(*mb, &msgs[0], (timeout == 0) ? INFINITE : (UINT_t) MS(timeout))) {
+
+    MBOX_STATS_WAIT(*mb, true);
+    return SYS_ARCH_TIMEOUT;
+  }
+
+  n = 1;
+  while (n < max && MBOX_GET(*mb, &msgs[n]))
+    ++n;
+
+  MBOX_STATS_WAIT(*mb, false);
+  MBOX_STATS_DEPTH(*mb, -n);
+  *count = n;
+  return waitedTime(start, timeout);
+}
+
 void sys_mbox_free(sys_mbox_t *mb)
 {
   if ((mb != NULL) && (*mb != NULL)) {
 
     sys_mbox_t mbox = *mb;
 
-    uosRingDestroy(mbox);
+#if SYS_ARCH_MBOX_BATCH > 0
+    if (batchMbox == mbox) {
+
+      batchMbox  = NULL;
+      batchNext  = 0;
+      batchCount = 0;
+#if SYS_ARCH_MBOX_PRIORITY
+      batchHigh  = 0;
+#endif
+    }
+#endif
+
+#if SYS_ARCH_STATS
+    statsDetach(&mbox->obj);
+#endif
+
+#if SYS_ARCH_MBOX_PRIORITY
+    if (mbox->lane != NULL) {
+
+      nosMemFree(mbox->lane);
+      mbox->lane = NULL;
+    }
+#endif
+
+#if SYS_ARCH_OBJECT_POOLS
+    void* msg;
+
+    // Mailbox should be empty, but make sure next user won't see anything.
+    while (mboxGet(mbox, &msg))
+      ;
+
+    poolPut(&mboxPool, mbox);
+#else
+    mboxDestroy(mbox);
+#endif
     SYS_STATS_DEC(mbox.used);
   }
 }
@@ -192,6 +1784,29 @@ void sys_mbox_free(sys_mbox_t *mb)
 #error SYS_LIGHTWIGHT_PROT must be defined as 1
 #endif
 
+#if SYS_ARCH_PROTECT_MUTEX
+
+/*
+ * Protection with recursive mutex. Only tasks that use lwIP
+ * contend for it, other tasks are not affected at all.
+ */
+static NOSMUTEX_t protMutex;
+
+sys_prot_t sys_arch_protect()
+{
+  LWIP_ASSERT("sys_init not called", protMutex != NULL);
+
+  nosMutexLock(protMutex);
+  return 0;
+}
+
+void sys_arch_unprotect(sys_prot_t flags)
+{
+  nosMutexUnlock(protMutex);
+}
+
+#else
+
 /*
  * Preemption protection.
  */
@@ -208,12 +1823,24 @@ void sys_arch_unprotect(sys_prot_t flags)
   POS_SCHED_UNLOCK;
 }
 
+#endif
+
 /*
  * Thread creation, use Pico]OS nano layer directly.
  */
 sys_thread_t sys_thread_new(const char *name, lwip_thread_fn thread, void *arg, int stacksize, int prio)
 {
+#if TRACK_TCPIP_THREAD
+  sys_thread_t t;
+
+  t = nosTaskCreate(thread, arg, prio, stacksize, name);
+  if (name != NULL && !strcmp(name, TCPIP_THREAD_NAME))
+    tcpipThread = t;
+
+  return t;
+#else
   return nosTaskCreate(thread, arg, prio, stacksize, name);
+#endif
 }
 
 /*
@@ -221,14 +1848,88 @@ sys_thread_t sys_thread_new(const char *name, lwip_thread_fn thread, void *arg,
  */
 void sys_init(void)
 {
+#if SYS_ARCH_PROTECT_MUTEX
+  if (protMutex == NULL)
+    protMutex = nosMutexCreate(0, "lwip_p");
+#endif
+
+#if SYS_ARCH_OBJECT_POOLS
+  int i;
+
+  if (semPool.stats.size > 0)
+    return;
+
+  for (i = 0; i < SYS_ARCH_SEM_POOL_SIZE; i++)
+    poolAdd(&semPool, semCreate(0));
+
+  for (i = 0; i < SYS_ARCH_MUTEX_POOL_SIZE; i++)
+    poolAdd(&mutexPool, mutexCreate());
+
+  for (i = 0; i < SYS_ARCH_MBOX_POOL_SIZE; i++)
+    poolAdd(&mboxPool, mboxCreate(SYS_ARCH_MBOX_POOL_MSGS));
+#endif
 }
 
 /*
- * System time.
+ * System time. Jiffies are extended to 64 bits here, so
+ * millisecond value wraps only at 2^32 like lwIP expects
+ * and not when jiffies * 1000 overflows. This works as long as
+ * clock is read at least once during jiffies wrap period, which
+ * lwIP timers take care of.
  */
+typedef struct {
+
+  JIF_t    last;
+  uint64_t ticks;
+} TickClock;
+
+static TickClock tickClock;
+
+#if SYS_ARCH_SELFTEST
+static JIF_t selftestJiffies; // added to jiffies during selftest
+#define SYS_JIFFIES() ((JIF_t) (jiffies + selftestJiffies))
+#else
+#define SYS_JIFFIES() jiffies
+#endif
+
+static uint64_t tickClockUpdate(TickClock* clock, JIF_t now)
+{
+  clock->ticks += (JIF_t) (now - clock->last);
+  clock->last = now;
+  return clock->ticks;
+}
+
+static uint64_t sysTicks(void)
+{
+  POS_LOCKFLAGS;
+  uint64_t ticks;
+
+  // Short section, so plain scheduler lock is ok in all protection modes.
+  POS_SCHED_LOCK;
+  ticks = tickClockUpdate(&tickClock, SYS_JIFFIES());
+  POS_SCHED_UNLOCK;
+  return ticks;
+}
+
 u32_t sys_now()
 {
-  return jiffies * 1000 / HZ;
+  return (u32_t) (sysTicks() * 1000 / HZ);
+}
+
+/*
+ * Microsecond clock. Unix port uses monotonic clock from host,
+ * others have only jiffies resolution.
+ */
+uint64_t sys_now_us()
+{
+#if SYS_ARCH_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  return sysTicks() * 1000000 / HZ;
+#endif
 }
 
 u32_t sys_jiffies()
@@ -250,3 +1951,123 @@ int sys_random(void)
   return (unsigned short)rand_r(&seedValue);
 }
 
+#if SYS_ARCH_SELFTEST
+
+/*
+ * Check that millisecond clock behaves when jiffies wrap
+ * and when milliseconds wrap. Returns 0 if ok.
+ */
+static int clockSelftestRun(JIF_t start, uint64_t ticks, int steps, JIF_t step)
+{
+  TickClock clock;
+  JIF_t     j;
+  u32_t     ms;
+  u32_t     prevMs;
+  uint64_t  prevTicks;
+  int       i;
+
+  clock.last  = start;
+  clock.ticks = ticks;
+  j           = start;
+  prevTicks   = ticks;
+  prevMs      = (u32_t) (ticks * 1000 / HZ);
+
+  for (i = 0; i < steps; i++) {
+
+    j += step;
+    if (tickClockUpdate(&clock, j) != prevTicks + step)
+      return -1;
+
+    ms = (u32_t) (clock.ticks * 1000 / HZ);
+    if ((u32_t) (ms - prevMs) - (u32_t) ((uint64_t) step * 1000 / HZ) > 1)
+      return -1;
+
+    prevTicks = clock.ticks;
+    prevMs = ms;
+  }
+
+  return 0;
+}
+
+/*
+ * Same through sys_now(), with jiffies seen by it moved near
+ * given value. Real jiffies may advance during test, so a few
+ * extra ticks are allowed. Clock is restored afterwards.
+ */
+static int sysNowSelftestRun(JIF_t start, uint64_t ticks)
+{
+  POS_LOCKFLAGS;
+  TickClock saved;
+  u32_t     ms;
+  u32_t     prevMs;
+  int       result;
+  int       i;
+
+  POS_SCHED_LOCK;
+  saved = tickClock;
+  selftestJiffies = start - jiffies;
+  tickClock.last  = start;
+  tickClock.ticks = ticks;
+  POS_SCHED_UNLOCK;
+
+  result = 0;
+  prevMs = sys_now();
+  for (i = 0; i < 20 * HZ; i++) {
+
+    POS_SCHED_LOCK;
+    ++selftestJiffies;
+    POS_SCHED_UNLOCK;
+
+    ms = sys_now();
+    if ((u32_t) (ms - prevMs) < 1000 / HZ || (u32_t) (ms - prevMs) > 4 * 1000 / HZ + 1) {
+
+      result = -1;
+      break;
+    }
+
+    prevMs = ms;
+  }
+
+  POS_SCHED_LOCK;
+  selftestJiffies = 0;
+  tickClock = saved;
+  POS_SCHED_UNLOCK;
+  return result;
+}
+
+/*
+ * Run selftests. sys_now() runs on simulated time during
+ * this, so call it before lwIP is started.
+ */
+int sys_arch_selftest(void)
+{
+  uint64_t msWrap = ((uint64_t) 1 << 32) * HZ / 1000;
+
+  // Jiffies wrap, one tick at a time and in large steps.
+  if (clockSelftestRun((JIF_t) (0 - 10 * HZ), 0, 20 * HZ, 1) != 0 ||
+      clockSelftestRun((JIF_t) (0 - 10 * HZ), 0, 16, (JIF_t) (0xffffffffUL / 4))) {
+
+    nosPrintf("sys_arch: jiffies wrap test failed.\n");
+    return -1;
+  }
+
+  // Milliseconds wrap at 2^32.
+  if (clockSelftestRun(0, msWrap - 10 * HZ, 20 * HZ, 1) != 0) {
+
+    nosPrintf("sys_arch: millisecond wrap test failed.\n");
+    return -1;
+  }
+
+  // Both through sys_now().
+  if (sysNowSelftestRun((JIF_t) (0 - 10 * HZ), 0) != 0 ||
+      sysNowSelftestRun(0, msWrap - 10 * HZ) != 0) {
+
+    nosPrintf("sys_arch: sys_now wrap test failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+#endif
+
@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2014, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Hierarchical timer wheel for lwIP timeouts. Replaces
+ * the sorted timeout list of lwIP core when both SYS_ARCH_TIMER_WHEEL
+ * and LWIP_TIMERS_CUSTOM are set to 1.
+ *
+ * Wheel is driven by Pico]OS jiffies. Root level has one slot
+ * for each tick, upper levels are cascaded down when root
+ * level wraps. Arming and cancelling timer are O(1),
+ * all timers in a slot expire as one batch.
+ */
+
+#include <picoos.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+
+#if SYS_ARCH_TIMER_WHEEL
+
+#if !LWIP_TIMERS || !LWIP_TIMERS_CUSTOM
+#error SYS_ARCH_TIMER_WHEEL requires LWIP_TIMERS and LWIP_TIMERS_CUSTOM
+#endif
+
+#include "lwip/timeouts.h"
+#include "lwip/def.h"
+
+#ifndef SYS_ARCH_TIMER_POOL_SIZE
+#define SYS_ARCH_TIMER_POOL_SIZE MEMP_NUM_SYS_TIMEOUT
+#endif
+
+// Must be power of two.
+#ifndef SYS_ARCH_TIMER_HASH_SIZE
+#define SYS_ARCH_TIMER_HASH_SIZE 64
+#endif
+
+#define ROOT_BITS   8
+#define ROOT_SIZE   (1 << ROOT_BITS)
+#define ROOT_MASK   (ROOT_SIZE - 1)
+#define LEVEL_BITS  6
+#define LEVEL_SIZE  (1 << LEVEL_BITS)
+#define LEVEL_MASK  (LEVEL_SIZE - 1)
+#define LEVELS      3
+#define MAX_TICKS   ((1UL << (ROOT_BITS + LEVELS * LEVEL_BITS)) - 1)
+
+typedef struct WheelLink {
+
+  struct WheelLink* next;
+  struct WheelLink* prev;
+} WheelLink;
+
+typedef struct WheelTimer {
+
+  WheelLink           link;      // must be first
+  struct WheelTimer*  hashNext;
+  struct WheelTimer** hashPrev;
+  u32_t               expires;
+  sys_timeout_handler handler;
+  void*               arg;
+} WheelTimer;
+
+static WheelLink   root[ROOT_SIZE];
+static WheelLink   levels[LEVELS][LEVEL_SIZE];
+static u32_t       rootBusy[ROOT_SIZE / 32]; // might be set also for empty slot
+static WheelTimer* hash[SYS_ARCH_TIMER_HASH_SIZE];
+static WheelTimer  pool[SYS_ARCH_TIMER_POOL_SIZE];
+static WheelTimer* freeList;
+static int         armed;
+
+static JIF_t       lastJiffies;
+static u32_t       clockTicks;
+static u32_t       wheelNow;   // next tick to process
+
+static void listInit(WheelLink* head)
+{
+  head->next = head;
+  head->prev = head;
+}
+
+static bool listEmpty(WheelLink* head)
+{
+  return head->next == head;
+}
+
+static void listAppend(WheelLink* head, WheelLink* link)
+{
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+static void listRemove(WheelLink* link)
+{
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+}
+
+static void listMove(WheelLink* to, WheelLink* from)
+{
+  if (listEmpty(from)) {
+
+    listInit(to);
+    return;
+  }
+
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  listInit(from);
+}
+
+static u32_t wheelClock(void)
+{
+  POS_LOCKFLAGS;
+  JIF_t now;
+
+  POS_SCHED_LOCK;
+  now = jiffies;
+  POS_SCHED_UNLOCK;
+
+  clockTicks += (JIF_t) (now - lastJiffies);
+  lastJiffies = now;
+  return clockTicks;
+}
+
+static u32_t msToTicks(u32_t msecs)
+{
+  uint64_t ticks = ((uint64_t) msecs * HZ + 999) / 1000;
+
+  return (ticks > MAX_TICKS) ? MAX_TICKS : (u32_t) ticks;
+}
+
+static u32_t ticksToMs(u32_t ticks)
+{
+  return (u32_t) (((uint64_t) ticks * 1000 + HZ - 1) / HZ);
+}
+
+static int hashIndex(sys_timeout_handler handler, void* arg)
+{
+  uintptr_t h = (uintptr_t) handler ^ (uintptr_t) arg;
+
+  h ^= h >> 7;
+  h ^= h >> 13;
+  return (int) (h & (SYS_ARCH_TIMER_HASH_SIZE - 1));
+}
+
+/*
+ * Put timer to correct slot, based on how far in future
+ * it expires.
+ */
+static void wheelAdd(WheelTimer* t)
+{
+  u32_t delta = t->expires - wheelNow;
+  int   slot;
+  int   level;
+
+  if ((int32_t) delta < 0) {
+
+    // Already due, expire with next tick processed.
+    t->expires = wheelNow;
+    delta = 0;
+  }
+
+  if (delta < ROOT_SIZE) {
+
+    slot = t->expires & ROOT_MASK;
+    rootBusy[slot / 32] |= 1UL << (slot % 32);
+    listAppend(&root[slot], &t->link);
+    return;
+  }
+
+  if (delta > MAX_TICKS) {
+
+    t->expires = wheelNow + MAX_TICKS;
+    delta = MAX_TICKS;
+  }
+
+  level = 0;
+  while (delta >= (1UL << (ROOT_BITS + (level + 1) * LEVEL_BITS)))
+    ++level;
+
+  slot = (t->expires >> (ROOT_BITS + level * LEVEL_BITS)) & LEVEL_MASK;
+  listAppend(&levels[level][slot], &t->link);
+}
+
+static void wheelRemove(WheelTimer* t)
+{
+  listRemove(&t->link);
+
+  *t->hashPrev = t->hashNext;
+  if (t->hashNext != NULL)
+    t->hashNext->hashPrev = t->hashPrev;
+
+  t->handler = NULL;
+  t->link.next = (WheelLink*) freeList;
+  freeList = t;
+  --armed;
+}
+
+static void wheelArm(u32_t expires, sys_timeout_handler handler, void* arg)
+{
+  WheelTimer* t;
+  WheelTimer** bucket;
+
+  t = freeList;
+  LWIP_ASSERT("sys_timeout: timer pool is empty", t != NULL);
+  if (t == NULL)
+    return;
+
+  freeList = (WheelTimer*) t->link.next;
+
+  t->expires = expires;
+  t->handler = handler;
+  t->arg     = arg;
+
+  bucket = &hash[hashIndex(handler, arg)];
+  t->hashNext = *bucket;
+  t->hashPrev = bucket;
+  if (*bucket != NULL)
+    (*bucket)->hashPrev = &t->hashNext;
+
+  *bucket = t;
+
+  ++armed;
+  wheelAdd(t);
+}
+
+/*
+ * Move timers from upper level slot to lower levels.
+ */
+static void wheelCascade(WheelLink* slot)
+{
+  WheelLink work;
+
+  listMove(&work, slot);
+  while (!listEmpty(&work)) {
+
+    WheelTimer* t = (WheelTimer*) work.next;
+
+    listRemove(&t->link);
+    wheelAdd(t);
+  }
+}
+
+/*
+ * Process all ticks up to (and including) now. Handlers
+ * can arm and cancel timers freely, as expiring batch
+ * is moved away from wheel before calling them.
+ */
+static void wheelRun(u32_t now)
+{
+  WheelLink work;
+  int       index;
+  int       level;
+  int       slot;
+
+  while ((int32_t) (now - wheelNow) >= 0) {
+
+    if (armed == 0) {
+
+      wheelNow = now + 1;
+      break;
+    }
+
+    index = wheelNow & ROOT_MASK;
+    if (index == 0) {
+
+      for (level = 0; level < LEVELS; level++) {
+
+        slot = (wheelNow >> (ROOT_BITS + level * LEVEL_BITS)) & LEVEL_MASK;
+        wheelCascade(&levels[level][slot]);
+        if (slot != 0)
+          break;
+      }
+    }
+
+    listMove(&work, &root[index]);
+    rootBusy[index / 32] &= ~(1UL << (index % 32));
+    ++wheelNow;
+
+    while (!listEmpty(&work)) {
+
+      WheelTimer*         t = (WheelTimer*) work.next;
+      sys_timeout_handler handler = t->handler;
+      void*               arg = t->arg;
+
+      wheelRemove(t);
+      handler(arg);
+    }
+  }
+}
+
+/*
+ * Find next tick that needs processing. It is either next
+ * busy root slot or start of next root round, when
+ * upper levels are cascaded.
+ */
+static u32_t wheelNext(void)
+{
+  int   index = wheelNow & ROOT_MASK;
+  int   word;
+  u32_t bits;
+
+  if (index == 0)
+    return wheelNow;
+
+  word = index / 32;
+  bits = rootBusy[word] & (0xffffffffUL << (index % 32));
+  while (true) {
+
+    if (bits != 0) {
+
+      index = word * 32;
+      while (!(bits & 1)) {
+
+        bits >>= 1;
+        ++index;
+      }
+
+      return (wheelNow & ~ROOT_MASK) + index;
+    }
+
+    if (++word == ROOT_SIZE / 32)
+      break;
+
+    bits = rootBusy[word];
+  }
+
+  return (wheelNow | ROOT_MASK) + 1;
+}
+
+/*
+ * lwIP timeout api. Cyclic timers come from lwip_cyclic_timers[]
+ * of lwIP core, which also provides an empty tcp_timer_needed()
+ * when LWIP_TIMERS_CUSTOM is set, so TCP timer runs all the time.
+ */
+
+/*
+ * Cyclic timers are re-armed relative to tick they
+ * were processed on, so they don't drift. If processing
+ * is late so much that next expiry has already passed,
+ * re-arm relative to current time instead.
+ */
+static void cyclicTimer(void* arg)
+{
+  const struct lwip_cyclic_timer* cyclic = (const struct lwip_cyclic_timer*) arg;
+  u32_t ticks;
+  u32_t next;
+
+  cyclic->handler();
+
+  ticks = msToTicks(cyclic->interval_ms);
+  next = wheelNow - 1 + ticks;
+  if ((int32_t) (next - clockTicks) < 0)
+    next = clockTicks + ticks;
+
+  wheelArm(next, cyclicTimer, arg);
+}
+
+void sys_timeouts_init(void)
+{
+  int i;
+
+  for (i = 0; i < ROOT_SIZE; i++)
+    listInit(&root[i]);
+
+  for (i = 0; i < LEVELS * LEVEL_SIZE; i++)
+    listInit(&levels[i / LEVEL_SIZE][i % LEVEL_SIZE]);
+
+  memset(rootBusy, '\0', sizeof(rootBusy));
+  memset(hash, '\0', sizeof(hash));
+
+  freeList = NULL;
+  for (i = SYS_ARCH_TIMER_POOL_SIZE - 1; i >= 0; i--) {
+
+    pool[i].handler = NULL;
+    pool[i].link.next = (WheelLink*) freeList;
+    freeList = &pool[i];
+  }
+
+  armed = 0;
+  lastJiffies = jiffies;
+  clockTicks = 0;
+  wheelNow = 1;
+
+  for (i = 0; i < lwip_num_cyclic_timers; i++)
+    sys_timeout(lwip_cyclic_timers[i].interval_ms, cyclicTimer,
+                LWIP_CONST_CAST(void*, &lwip_cyclic_timers[i]));
+}
+
+#if LWIP_DEBUG_TIMERNAMES
+void sys_timeout_debug(u32_t msecs, sys_timeout_handler handler, void* arg, const char* name)
+#else
+void sys_timeout(u32_t msecs, sys_timeout_handler handler, void* arg)
+#endif
+{
+  LWIP_ASSERT_CORE_LOCKED();
+
+  wheelArm(wheelClock() + msToTicks(msecs), handler, arg);
+}
+
+/*
+ * Cancel a timer. If there are several timers with same
+ * handler and argument, only one of them is cancelled.
+ */
+void sys_untimeout(sys_timeout_handler handler, void* arg)
+{
+  WheelTimer* t;
+
+  LWIP_ASSERT_CORE_LOCKED();
+
+  for (t = hash[hashIndex(handler, arg)]; t != NULL; t = t->hashNext) {
+
+    if (t->handler == handler && t->arg == arg) {
+
+      wheelRemove(t);
+      return;
+    }
+  }
+}
+
+void sys_check_timeouts(void)
+{
+  LWIP_ASSERT_CORE_LOCKED();
+
+  wheelRun(wheelClock());
+}
+
+u32_t sys_timeouts_sleeptime(void)
+{
+  u32_t now;
+  u32_t next;
+
+  LWIP_ASSERT_CORE_LOCKED();
+
+  if (armed == 0)
+    return SYS_TIMEOUTS_SLEEPTIME_INFINITE;
+
+  now = wheelClock();
+  if ((int32_t) (now - wheelNow) >= 0)
+    return 0;
+
+  next = wheelNext();
+  return ticksToMs(next - now);
+}
+
+/*
+ * Rebase all timers to current time, as if
+ * time had stopped since last check.
+ */
+void sys_restart_timeouts(void)
+{
+  u32_t shift;
+  int   i;
+
+  LWIP_ASSERT_CORE_LOCKED();
+
+  shift = wheelClock() + 1 - wheelNow;
+  if (shift == 0)
+    return;
+
+  for (i = 0; i < SYS_ARCH_TIMER_POOL_SIZE; i++)
+    if (pool[i].handler != NULL)
+      listRemove(&pool[i].link);
+
+  memset(rootBusy, '\0', sizeof(rootBusy));
+  wheelNow += shift;
+
+  for (i = 0; i < SYS_ARCH_TIMER_POOL_SIZE; i++) {
+
+    if (pool[i].handler != NULL) {
+
+      pool[i].expires += shift;
+      wheelAdd(&pool[i]);
+    }
+  }
+}
+
+#endif